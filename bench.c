@@ -0,0 +1,456 @@
+// Benchmark driver for spell.c. Generates a deterministic dictionary and
+// text corpus, then times dictionary loading, lookups and file checking.
+//
+//   make bench
+//   ./bench [-w {dictionary words}] [-n {corpus words}] [-e {error rate}]
+//           [-c {capitalization rate}] [-r {seed}] [-o {directory}]
+//
+// With -o the generated dictionary.txt and corpus.txt are kept in the given
+// directory, so the spell binary itself can be timed on them.
+#define SPELL_NO_MAIN
+#include "spell.c"
+#include <time.h>
+#include <sys/resource.h>
+
+
+typedef struct {
+    long dict_words;
+    long corpus_words;
+    double error_rate;
+    double cap_rate;
+    uint64_t seed;
+} BenchConfig;
+
+
+// A token of the corpus, already stripped of punctuation.
+typedef struct {
+    const char *word;
+    size_t len;
+} Token;
+
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+
+uint64_t rng_next(Rng *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+
+double rng_unit(Rng *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+
+// Writes dict_words random words, a few of them capitalized or acronyms,
+// one per line, and returns them in file order.
+char **generate_dictionary(const BenchConfig *cfg, Rng *rng, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    char **words = malloc(cfg->dict_words * sizeof(char *));
+    for (long i = 0; i < cfg->dict_words; i++) {
+        int len = 3 + rng_next(rng) % 12;
+        char *word = malloc(len + 1);
+        for (int j = 0; j < len; j++) word[j] = 'a' + rng_next(rng) % 26;
+        word[len] = '\0';
+        double kind = rng_unit(rng);
+        if (kind < 0.05) {
+            word[0] = toupper((unsigned char)word[0]);
+        } else if (kind < 0.06) {
+            for (int j = 0; j < len; j++) word[j] = toupper((unsigned char)word[j]);
+        }
+        fprintf(out, "%s\n", word);
+        words[i] = word;
+    }
+    fclose(out);
+    return words;
+}
+
+
+// Writes corpus_words tokens drawn with a skew towards the front of the
+// dictionary, roughly like word frequencies in real text. A share of them
+// is misspelled, recapitalized or followed by punctuation.
+void generate_corpus(const BenchConfig *cfg, Rng *rng, char **words, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    char token[MAX_WORD_LEN];
+    for (long i = 0; i < cfg->corpus_words; i++) {
+        double u = rng_unit(rng);
+        long idx = (long)(u * u * u * cfg->dict_words);
+        strcpy(token, words[idx]);
+        int len = strlen(token);
+
+        if (rng_unit(rng) < cfg->error_rate)
+            token[rng_next(rng) % len] = 'a' + rng_next(rng) % 26;
+        if (rng_unit(rng) < cfg->cap_rate) {
+            if (rng_next(rng) & 1)
+                token[0] = toupper((unsigned char)token[0]);
+            else
+                for (int j = 0; j < len; j++) token[j] = toupper((unsigned char)token[j]);
+        }
+        if (rng_unit(rng) < 0.05) token[len++] = ",.;:!?"[rng_next(rng) % 6];
+        token[len] = '\0';
+
+        fputs(token, out);
+        fputc(i % 12 == 11 ? '\n' : ' ', out);
+    }
+    fclose(out);
+}
+
+
+char *read_whole_file(const char *path, size_t *size) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(in, 0, SEEK_END);
+    *size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *text = malloc(*size + 1);
+    *size = fread(text, 1, *size, in);
+    fclose(in);
+    return text;
+}
+
+
+// Splits text into the spans check_word would look up.
+Token *collect_tokens(const char *text, size_t size, long *count) {
+    long capacity = 1024;
+    Token *tokens = malloc(capacity * sizeof(Token));
+    *count = 0;
+    size_t i = 0;
+    while (i < size) {
+        while (i < size && isspace((unsigned char)text[i])) i++;
+        size_t start = i;
+        while (i < size && !isspace((unsigned char)text[i])) i++;
+        if (i == start) continue;
+        const char *end = text + i;
+        const char *word = strip_leading_punctuation(text + start, end);
+        end = strip_trailing_punctuation(word, end);
+        if (end == word || is_all_digits_or_symbols(word, end - word)) continue;
+        if (*count == capacity) {
+            capacity *= 2;
+            tokens = realloc(tokens, capacity * sizeof(Token));
+        }
+        tokens[*count].word = word;
+        tokens[*count].len = end - word;
+        (*count)++;
+    }
+    return tokens;
+}
+
+
+// Heap and mapped bytes held by a dictionary.
+size_t dictionary_bytes(const Dictionary *dict) {
+    size_t bytes = dict->size;
+    for (const ArenaChunk *chunk = dict->arena.head; chunk; chunk = chunk->next)
+        bytes += chunk->size;
+    return bytes;
+}
+
+
+void bench_lookups(const char *label, Dictionary *dict, const Token *tokens, long count) {
+    long hits = 0;
+    double start = now_seconds();
+    for (long i = 0; i < count; i++)
+        hits += word_in_dictionary(dict, tokens[i].word, tokens[i].len, NULL);
+    double elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.0f lookups/s  (%.1f%% hits)\n", label, elapsed,
+           count / elapsed, 100.0 * hits / count);
+}
+
+
+// Times both dictionary sorts on the same shuffled copy of the entries.
+void bench_sort(Dictionary *dict, Rng *rng) {
+    size_t n = dict->count;
+    DictEntry *shuffled = malloc(n * sizeof(DictEntry));
+    DictEntry *entries = malloc(n * sizeof(DictEntry));
+    DictEntry *tmp = malloc(n * sizeof(DictEntry));
+    uint16_t *digits = malloc(n * sizeof(uint16_t));
+    memcpy(shuffled, dict->entries, n * sizeof(DictEntry));
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = rng_next(rng) % (i + 1);
+        DictEntry e = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = e;
+    }
+
+    memcpy(entries, shuffled, n * sizeof(DictEntry));
+    double start = now_seconds();
+    qsort_entries(entries, n, dict->keys);
+    printf("  %-34s %8.3f s\n", "sort_dictionary (qsort)", now_seconds() - start);
+
+    memcpy(entries, shuffled, n * sizeof(DictEntry));
+    start = now_seconds();
+    radix_sort_entries(entries, tmp, digits, n, dict->keys, 0);
+    printf("  %-34s %8.3f s\n", "sort_dictionary (radix)", now_seconds() - start);
+
+    free(shuffled);
+    free(entries);
+    free(tmp);
+    free(digits);
+}
+
+
+void bench_check_file(const char *label, Dictionary *dict, const char *path,
+                      size_t size, long words) {
+    OutBuf out = { NULL, 0, 0, -1, 0 };
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    Checker ck = { dict, &out, NULL, &stats, NULL, 0, NULL, NULL };
+    double start = now_seconds();
+    check_file(&ck, path, 1);
+    double elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.0f words/s  %8.1f MB/s\n", label, elapsed,
+           words / elapsed, size / elapsed / 1e6);
+    out_free(&out);
+    release_checker(&ck);
+}
+
+
+// Times suggest_corrections on each of the misspelled words.
+void bench_suggest(const char *label, Dictionary *dict, const Token *words, long count) {
+    Suggestion best[SUGGEST_MAX];
+    long corrected = 0;
+    double start = now_seconds();
+    for (long i = 0; i < count; i++)
+        corrected += suggest_corrections(dict, words[i].word, words[i].len, best,
+                                         SUGGEST_DEFAULT, NULL) > 0;
+    double elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.1f us/word  (%.1f%% corrected)\n", label, elapsed,
+           elapsed / count * 1e6, 100.0 * corrected / count);
+}
+
+
+// Compares the distance kernels on every misspelled word against the same
+// random sample of keys. The sums show that they agree.
+void bench_edit_distance(Dictionary *dict, const Token *words, long count, Rng *rng) {
+    enum { KEYS = 1024 };
+    const char *keys[KEYS];
+    size_t lens[KEYS];
+    for (int k = 0; k < KEYS; k++) {
+        const DictEntry *e = &dict->entries[rng_next(rng) % dict->count];
+        keys[k] = dict->keys + e->offset;
+        lens[k] = e->len;
+    }
+    char folded[MAX_WORD_LEN];
+    int distances[KEYS];
+    long pairs = count * KEYS;
+
+    long sum = 0;
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        for (size_t j = 0; j < words[i].len; j++) folded[j] = fold_case(words[i].word[j]);
+        for (int k = 0; k < KEYS; k++)
+            sum += edit_distance(folded, words[i].len, keys[k], lens[k], MAX_WORD_LEN);
+    }
+    double elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.1f ns/pair  (sum %ld)\n", "edit_distance (DP)",
+           elapsed, elapsed / pairs * 1e9, sum);
+
+    MyersPattern pattern;
+    sum = 0;
+    start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        for (size_t j = 0; j < words[i].len; j++) folded[j] = fold_case(words[i].word[j]);
+        myers_pattern(&pattern, folded, words[i].len);
+        for (int k = 0; k < KEYS; k++)
+            sum += myers_distance(&pattern, keys[k], lens[k], MAX_WORD_LEN);
+    }
+    elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.1f ns/pair  (sum %ld)\n", "myers_distance", elapsed,
+           elapsed / pairs * 1e9, sum);
+
+    sum = 0;
+    start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        for (size_t j = 0; j < words[i].len; j++) folded[j] = fold_case(words[i].word[j]);
+        myers_pattern(&pattern, folded, words[i].len);
+        myers_distances(&pattern, keys, lens, KEYS, distances);
+        for (int k = 0; k < KEYS; k++) sum += distances[k];
+    }
+    elapsed = now_seconds() - start;
+    printf("  %-34s %8.3f s  %10.1f ns/pair  (sum %ld)\n", "myers_distances (batch)", elapsed,
+           elapsed / pairs * 1e9, sum);
+}
+
+
+void usage() {
+    fprintf(stderr, "Usage: bench [-w {dictionary words}] [-n {corpus words}] "
+                    "[-e {error rate}] [-c {capitalization rate}] [-r {seed}] "
+                    "[-o {directory}]\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    BenchConfig cfg = { 500000, 5000000, 0.02, 0.10, 1 };
+    const char *keep_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) usage();
+        if (strcmp(argv[i], "-w") == 0) cfg.dict_words = atol(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0) cfg.corpus_words = atol(argv[++i]);
+        else if (strcmp(argv[i], "-e") == 0) cfg.error_rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0) cfg.cap_rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0) cfg.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0) keep_dir = argv[++i];
+        else usage();
+    }
+    if (cfg.dict_words < 1 || cfg.corpus_words < 1) usage();
+
+    char dir[] = "/tmp/spell-bench-XXXXXX";
+    if (keep_dir) {
+        mkdir(keep_dir, 0777);
+    } else if (!mkdtemp(dir)) {
+        fprintf(stderr, "Error: Cannot create a temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    const char *base = keep_dir ? keep_dir : dir;
+    char dict_path[1024], spd_path[1024], corpus_path[1024], overlay_path[1024];
+    snprintf(dict_path, sizeof(dict_path), "%s/dictionary.txt", base);
+    snprintf(overlay_path, sizeof(overlay_path), "%s/overlay.txt", base);
+    snprintf(spd_path, sizeof(spd_path), "%s/dictionary.spd", base);
+    snprintf(corpus_path, sizeof(corpus_path), "%s/corpus.txt", base);
+
+    select_tokenizer();
+    Rng rng = { cfg.seed };
+    double start = now_seconds();
+    char **words = generate_dictionary(&cfg, &rng, dict_path);
+    generate_corpus(&cfg, &rng, words, corpus_path);
+    printf("generated %ld dictionary words and %ld corpus words in %.2f s\n",
+           cfg.dict_words, cfg.corpus_words, now_seconds() - start);
+    for (long i = 0; i < cfg.dict_words; i++) free(words[i]);
+    free(words);
+
+    printf("dictionary\n");
+    start = now_seconds();
+    Dictionary *dict = load_dictionary(dict_path);
+    if (!dict) return EXIT_FAILURE;
+    printf("  %-34s %8.3f s\n", "load_dictionary (text)", now_seconds() - start);
+    bench_sort(dict, &rng);
+    start = now_seconds();
+    build_hash_index(dict);
+    printf("  %-34s %8.3f s\n", "build_hash_index", now_seconds() - start);
+    compile_dictionary(dict, spd_path);
+    start = now_seconds();
+    Dictionary *compiled = load_dictionary(spd_path);
+    if (!compiled) return EXIT_FAILURE;
+    printf("  %-34s %8.3f s\n", "load_dictionary (compiled)", now_seconds() - start);
+
+    size_t corpus_size;
+    char *corpus = read_whole_file(corpus_path, &corpus_size);
+    long token_count;
+    Token *tokens = collect_tokens(corpus, corpus_size, &token_count);
+
+    printf("lookups\n");
+    HashSlot *slots = dict->slots;
+    dict->slots = NULL;
+    bench_lookups("word_in_dictionary (sorted)", dict, tokens, token_count);
+    dict->slots = slots;
+    bench_lookups("word_in_dictionary (hash)", dict, tokens, token_count);
+    bench_lookups("word_in_dictionary (.spd)", compiled, tokens, token_count);
+    // A project word list: the first 50 words the dictionary lacks.
+    FILE *overlay_out = fopen(overlay_path, "w");
+    for (long i = 0, n = 0; i < token_count && n < 50; i++) {
+        if (word_in_dictionary(compiled, tokens[i].word, tokens[i].len, NULL)) continue;
+        fprintf(overlay_out, "%.*s\n", (int)tokens[i].len, tokens[i].word);
+        n++;
+    }
+    fclose(overlay_out);
+    start = now_seconds();
+    Dictionary *overlay = load_dictionary(overlay_path);
+    if (!overlay) return EXIT_FAILURE;
+    build_hash_index(overlay);
+    add_overlay(compiled, overlay);
+    printf("  %-34s %8.3f ms\n", "load_dictionary (50-word overlay)",
+           (now_seconds() - start) * 1e3);
+    bench_lookups("word_in_dictionary (.spd, overlay)", compiled, tokens, token_count);
+    start = now_seconds();
+    build_bloom_filter(dict, BLOOM_DEFAULT_BITS);
+    printf("  %-34s %8.3f s\n", "build_bloom_filter", now_seconds() - start);
+    dict->slots = NULL;
+    bench_lookups("word_in_dictionary (sorted, bloom)", dict, tokens, token_count);
+    dict->slots = slots;
+    bench_lookups("word_in_dictionary (hash, bloom)", dict, tokens, token_count);
+    dict->bloom = NULL;
+    start = now_seconds();
+    Dictionary *trie = build_trie_dictionary(load_dictionary(dict_path));
+    printf("  %-34s %8.3f s  %zu nodes, %zu edges\n", "load + build_trie_dictionary",
+           now_seconds() - start, trie->trie->node_count, trie->trie->edge_count);
+    bench_lookups("word_in_dictionary (trie)", trie, tokens, token_count);
+    printf("  %-34s %8zu KB\n", "dictionary memory (hash)", dictionary_bytes(dict) / 1024);
+    printf("  %-34s %8zu KB\n", "dictionary memory (trie)", dictionary_bytes(trie) / 1024);
+    free_dictionary(trie);
+    free_dictionary(compiled);
+
+    printf("check_file\n");
+    bench_check_file("check_file (hash)", dict, corpus_path, corpus_size, cfg.corpus_words);
+    start = now_seconds();
+    build_suggestion_index(dict);
+    printf("  %-34s %8.3f s  %10zu deletes\n", "build_suggestion_index", now_seconds() - start,
+           dict->delete_count);
+    suggestion_limit = SUGGEST_DEFAULT;
+    bench_check_file("check_file (suggest)", dict, corpus_path, corpus_size, cfg.corpus_words);
+
+    // The automaton walks the whole key list for every word, so it is
+    // timed on a sample of the misspellings rather than the corpus.
+    printf("suggestions\n");
+    long misspelled_count = 0;
+    Token *misspelled = malloc(1000 * sizeof(Token));
+    for (long i = 0; i < token_count && misspelled_count < 1000; i++)
+        if (!word_in_dictionary(dict, tokens[i].word, tokens[i].len, NULL))
+            misspelled[misspelled_count++] = tokens[i];
+    if (misspelled_count) {
+        bench_suggest("suggest_corrections (deletes)", dict, misspelled, misspelled_count);
+        uint64_t *deletes = dict->deletes;
+        dict->deletes = NULL;
+        bench_suggest("suggest_corrections (automaton)", dict, misspelled, misspelled_count);
+        dict->deletes = deletes;
+    }
+    if (misspelled_count) bench_edit_distance(dict, misspelled, misspelled_count, &rng);
+    size_t bucket_count = ((size_t)1 << (64 - dict->delete_shift)) + 1;
+    printf("  %-34s %8zu KB\n", "delete index memory",
+           (dict->delete_count * sizeof(uint64_t) + bucket_count * sizeof(uint64_t)) / 1024);
+    free(misspelled);
+
+    printf("peak RSS %ld KB\n", peak_rss_kb());
+
+    free(tokens);
+    free(corpus);
+    free_dictionary(dict);
+    if (!keep_dir) {
+        unlink(dict_path);
+        unlink(spd_path);
+        unlink(corpus_path);
+        unlink(overlay_path);
+        rmdir(dir);
+    }
+    return EXIT_SUCCESS;
+}
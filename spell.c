@@ -1,85 +1,829 @@
-#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 
 #define MAX_WORD_LEN 256
-#define BUFFER_SIZE 4096
-#define INITIAL_DICT_SIZE 1000
+#define READ_BUFFER_SIZE (64 * 1024)
+#define MMAP_THRESHOLD (1024 * 1024)
+#define VERDICT_CACHE_BITS 12
+#define VERDICT_KEY_MAX 24
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+#define RADIX_CUTOFF 32
+#define PATH_BUFFER_SIZE 4096
+#define TRIE_TERMINAL 0x80000000u
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_DEFAULT_BITS 10
+#define SUGGEST_PREFIX_LEN 7
+#define SUGGEST_MAX_DISTANCE 2
+#define SUGGEST_DEFAULT 3
+#define SUGGEST_MAX 16
+#define MYERS_LANES 4
+#define SUGGEST_BATCH 16
+#define SPD_MAGIC "SPD\x1a"
+#define SPD_VERSION 4
+#define CACHE_MAGIC "SPC\x1a"
+#define CACHE_VERSION 2
+#define CLIENT_TIMEOUT_SECONDS 5
+
+
+// Bump-pointer allocator: memory is carved from large chunks and released
+// all at once. Oversized requests get a chunk of their own.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+} ArenaChunk;
 
 
 typedef struct {
-    char *original;  
-    char *normalized;
-} DictEntry;
+    ArenaChunk *head;
+} Arena;
+
 
+// Capitalization class of a dictionary word, fixed when it is loaded.
+enum {
+    CAP_LOWER,
+    CAP_INITIAL,
+    CAP_UPPER,
+    CAP_MIXED
+};
 
+
+// Entries index into the dictionary text: the word as written lives at
+// words + offset and its lower-cased form at keys + offset. Both blobs
+// point into data, the mapped or read dictionary file, when possible.
+// upper_mask has bit i set when character i of the word is upper case.
 typedef struct {
+    uint32_t offset;
+    uint16_t len;
+    uint8_t cap_class;
+    uint8_t reserved;
+    uint64_t upper_mask;
+} DictEntry;
+
+
+// A dictionary may carry overlays (-d): small word lists indexed on their
+// own and consulted, smallest first, for words it lacks, so adding one
+// never means sorting or indexing the base again.
+typedef struct Dictionary {
+    Arena arena;
     DictEntry *entries;
     int count;
     int capacity;
+    const char *data;
+    const char *words;
+    char *keys;
+    size_t size;
+    int mapped;
+    int compiled;
+    struct HashSlot *slots;
+    uint32_t slot_mask;
+    uint32_t *bloom;
+    uint32_t bloom_blocks;
+    struct Trie *trie;
+    uint64_t *deletes;
+    size_t delete_count;
+    uint64_t *delete_buckets;
+    int delete_shift;
+    struct Dictionary **overlays;
+    int overlay_count;
 } Dictionary;
 
 
+// One slot of the open-addressing index: the run of case variants sharing a
+// normalized key, identified by its first sorted entry. Empty when count is 0.
+typedef struct HashSlot {
+    uint32_t hash;
+    uint32_t first;
+    uint32_t count;
+} HashSlot;
+
+
+// Dictionary kept as a minimized DAWG of its keys (--index trie). Node i
+// owns edges nodes[i] to nodes[i + 1], masked with ~TRIE_TERMINAL, sorted
+// by label; TRIE_TERMINAL marks nodes that end a key. Each edge packs its
+// rank (high half) and target node (low half). Key k, counted in sorted
+// order, owns the case variants run_starts[k] to run_starts[k + 1].
+// Variants keep only their capitalization class, plus the upper-case mask
+// of mixed-case words and the text of words longer than 64 characters.
+typedef struct Trie {
+    uint32_t root;
+    uint32_t *nodes;
+    uint8_t *labels;
+    uint64_t *edges;
+    size_t node_count;
+    size_t edge_count;
+    uint32_t *run_starts;
+    uint8_t *cap_classes;
+    uint32_t mixed_count;
+    uint32_t *mixed_variants;
+    uint64_t *mixed_masks;
+    uint32_t long_count;
+    uint32_t *long_variants;
+    uint32_t *long_offsets;
+    char *long_text;
+} Trie;
+
+
+// Header of a compiled (.spd) dictionary. It is followed by the sorted
+// entries, the hash index (slot_count slots, or none), the delete index for
+// suggestions (2^delete_bits + 1 buckets and delete_count pairs, or none)
+// and then the words and keys blobs, each text_size bytes long. Everything
+// is used in place from a shared read-only mapping, so concurrent processes
+// share one copy.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t text_size;
+    uint32_t slot_count;
+    uint32_t delete_bits;
+    uint64_t slots_offset;
+    uint64_t words_offset;
+    uint64_t keys_offset;
+    uint64_t buckets_offset;
+    uint64_t deletes_offset;
+    uint64_t delete_count;
+} SpdHeader;
+
+
+// Growable buffer that misspelling reports are formatted into. Buffers with
+// an fd are written out with write() once they fill up; the others only
+// collect a report for someone else to print. failed is set once a write
+// fails, and whatever is flushed after that is dropped.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int fd;
+    int failed;
+} OutBuf;
+
+
+typedef struct {
+    double wall;
+    double cpu;
+} PhaseTime;
+
+
+enum {
+    PHASE_LOAD_DICTIONARY,
+    PHASE_SORT_DICTIONARY,
+    PHASE_BUILD_SUGGESTIONS,
+    PHASE_CHECK_DIRECTORY,
+    PHASE_CHECK_FILE,
+    PHASE_COUNT
+};
+
+
+enum {
+    STAT_FILES,
+    STAT_CACHE_HITS,
+    STAT_BYTES_READ,
+    STAT_IO_SYSCALLS,
+    STAT_TOKENS,
+    STAT_VERDICT_HITS,
+    STAT_LOOKUPS,
+    STAT_BLOOM_REJECTS,
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_CASE_COMPARISONS,
+    STAT_EDIT_DISTANCES,
+    STAT_COUNT
+};
+
+
+// Timings and counters reported by --stats. Every thread counts into its
+// own Stats; they are added together with merge_stats at the end. Phase
+// wall times are those of the main thread and never overlap, so they add
+// up to the run; with -j, check_file is the wait for the workers once the
+// walk is done. Phase CPU times are summed over the threads doing the work.
+typedef struct {
+    PhaseTime phases[PHASE_COUNT];
+    uint64_t counters[STAT_COUNT];
+} Stats;
+
+
+const char *phase_names[PHASE_COUNT] = {
+    "load_dictionary", "sort_dictionary", "build_suggestions", "check_directory", "check_file"
+};
+
+
+const char *stat_names[STAT_COUNT] = {
+    "files", "cache_hits", "bytes_read", "io_syscalls", "tokens", "verdict_hits", "lookups",
+    "bloom_rejects", "hits", "misses", "case_comparisons", "edit_distances"
+};
+
+
+// A candidate correction: the dictionary layer it comes from, the first
+// entry of its key's run there and its distance from the misspelled word.
+typedef struct {
+    int distance;
+    int first;
+    const Dictionary *dict;
+} Suggestion;
+
+
+// A file queued for a worker thread, with its report kept until every
+// earlier file has been printed.
+typedef struct {
+    char *path;
+    int show_filename;
+    OutBuf output;
+    int error_found;
+    int done;
+} Job;
+
+
+typedef struct {
+    Dictionary *dict;
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    Job *jobs;
+    size_t job_count;
+    size_t job_capacity;
+    size_t next_job;
+    size_t next_print;
+    int printing;
+    int closed;
+    int error_found;
+    int output_failed;
+    Stats stats;
+} WorkPool;
+
+
+// What check_word concluded about a token, remembered by the token's raw
+// bytes: where the word is once punctuation is stripped, and whether it is
+// spelled correctly. Tokens longer than VERDICT_KEY_MAX are not kept.
+enum {
+    VERDICT_SKIP,
+    VERDICT_CORRECT,
+    VERDICT_MISSPELLED
+};
+
+
+typedef struct {
+    uint64_t key[VERDICT_KEY_MAX / 8];
+    uint8_t len;
+    uint8_t verdict;
+    uint8_t lead;
+    uint8_t stripped_len;
+    uint8_t suggestion_count;
+    uint8_t reserved[3];
+} VerdictEntry;
+
+
+// Per-thread state of a check. Files found while walking directories are
+// handed to pool when one is running and checked in place otherwise. The
+// read buffer and the direct-mapped verdict cache are kept from file to
+// file and released with release_checker. With --suggest, each verdict
+// slot owns suggestion_limit entries of suggestions.
+typedef struct {
+    Dictionary *dict;
+    OutBuf *out;
+    WorkPool *pool;
+    Stats *stats;
+    char *buffer;
+    size_t buffer_size;
+    VerdictEntry *verdicts;
+    Suggestion *suggestions;
+} Checker;
+
+
+// Scanning state of check_file, carried from one read to the next. A word
+// that straddles two reads is collected in word.
+typedef struct {
+    const char *filename;
+    int line;
+    uint64_t offset;
+    uint64_t line_start;
+    uint32_t prev_space;
+    int in_word;
+    int word_line;
+    int word_col;
+    char word[MAX_WORD_LEN];
+    int word_len;
+    int error_found;
+} Tokenizer;
+
+
+// Classifies a 32-byte block: returns the mask of whitespace bytes (bit i
+// for p[i]) and stores the mask of newlines in *newlines.
+typedef uint32_t (*ClassifyFn)(const unsigned char *p, uint32_t *newlines);
+
+
+#define ARENA_HEADER_SIZE ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(ARENA_HEADER_SIZE + chunk_size);
+        if (!chunk) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        // Keep filling the current chunk if the new one is already full.
+        if (arena->head && chunk_size == size) {
+            chunk->next = arena->head->next;
+            arena->head->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+    }
+    void *ptr = (char *)chunk + ARENA_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
+
+
+// Set by --stats. Phases are only timed when it is on; counters are always
+// kept since they cost no more than the test would. The main thread's
+// phases and counters go to run_stats.
+int stats_enabled = 0;
+Stats run_stats;
+
+
+// Set by --suggest: how many corrections to print with each misspelling.
+int suggestion_limit = 0;
+// Set by --suggest-engine automaton: suggestions come from a Levenshtein
+// automaton over the sorted keys instead of a symmetric-delete index.
+int suggest_automaton = 0;
+// Cleared by --watch and --serve. A mapped file that is cut short while it
+// is checked raises SIGBUS, which a process that runs on must not die of,
+// so large files are then read like any other.
+int map_input_files = 1;
+
+
+PhaseTime phase_start() {
+    PhaseTime now = { 0, 0 };
+    if (stats_enabled) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now.wall = ts.tv_sec + ts.tv_nsec * 1e-9;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        now.cpu = ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+    return now;
+}
+
+
+void phase_end(PhaseTime *phase, PhaseTime start) {
+    if (!stats_enabled) return;
+    PhaseTime now = phase_start();
+    phase->wall += now.wall - start.wall;
+    phase->cpu += now.cpu - start.cpu;
+}
+
+
+// Takes out of phase the time spent since before in a phase nested in it,
+// whose total is inner.
+void phase_exclude(PhaseTime *phase, const PhaseTime *inner, PhaseTime before) {
+    phase->wall -= inner->wall - before.wall;
+    phase->cpu -= inner->cpu - before.cpu;
+}
+
+
+// Adds the counters and phase CPU times of another thread. Its wall times
+// overlap the main thread's and are left out.
+void merge_stats(Stats *into, const Stats *from) {
+    for (int i = 0; i < PHASE_COUNT; i++)
+        into->phases[i].cpu += from->phases[i].cpu;
+    for (int i = 0; i < STAT_COUNT; i++)
+        into->counters[i] += from->counters[i];
+}
+
+
+// Read, map and advice calls per megabyte of checked text.
+double io_syscalls_per_mb(const Stats *stats) {
+    uint64_t bytes = stats->counters[STAT_BYTES_READ];
+    return bytes ? stats->counters[STAT_IO_SYSCALLS] / (bytes / 1e6) : 0.0;
+}
+
+
+// Share of tokens answered from the verdict cache.
+double verdict_hit_rate(const Stats *stats) {
+    uint64_t tokens = stats->counters[STAT_TOKENS];
+    return tokens ? (double)stats->counters[STAT_VERDICT_HITS] / tokens : 0.0;
+}
+
+
+void print_stats(const Stats *stats, int json) {
+    if (json) {
+        fprintf(stderr, "{\"phases\": {");
+        for (int i = 0; i < PHASE_COUNT; i++)
+            fprintf(stderr, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", i ? ", " : "",
+                    phase_names[i], stats->phases[i].wall, stats->phases[i].cpu);
+        fprintf(stderr, "}, \"counters\": {");
+        for (int i = 0; i < STAT_COUNT; i++)
+            fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", stat_names[i],
+                    (unsigned long long)stats->counters[i]);
+        fprintf(stderr, "}, \"io_syscalls_per_mb\": %.3f, \"verdict_hit_rate\": %.3f}\n",
+                io_syscalls_per_mb(stats), verdict_hit_rate(stats));
+        return;
+    }
+    fprintf(stderr, "%-18s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(stderr, "%-18s %12.6f %12.6f\n", phase_names[i],
+                stats->phases[i].wall, stats->phases[i].cpu);
+    for (int i = 0; i < STAT_COUNT; i++)
+        fprintf(stderr, "%-18s %12llu\n", stat_names[i], (unsigned long long)stats->counters[i]);
+    fprintf(stderr, "%-18s %12.3f\n", "io_syscalls_per_mb", io_syscalls_per_mb(stats));
+    fprintf(stderr, "%-18s %12.3f\n", "verdict_hit_rate", verdict_hit_rate(stats));
+}
+
+
+// The dictionary lives in the first chunk of its own arena, so entries,
+// keys and indexes are all released together by free_dictionary.
 Dictionary *create_dictionary() {
-    Dictionary *dict = malloc(sizeof(Dictionary));
-    dict->capacity = INITIAL_DICT_SIZE;
-    dict->entries = malloc(dict->capacity * sizeof(DictEntry));
-    dict->count = 0;
+    Arena arena = { NULL };
+    Dictionary *dict = arena_alloc(&arena, sizeof(Dictionary));
+    memset(dict, 0, sizeof(Dictionary));
+    dict->arena = arena;
     return dict;
 }
 
 
-void normalize_word(const char *word, char *normalized) {
-    int i = 0;
-    while (word[i]) {
-        if (word[i] != '\r' && word[i] != '\n')
-            normalized[i] = tolower((unsigned char)word[i]);
-        else
-            normalized[i] = '\0';
-        i++;
-    }
-    normalized[i] = '\0';
+void normalize_word(const char *word, size_t len, char *normalized) {
+    for (size_t i = 0; i < len; i++)
+        normalized[i] = tolower((unsigned char)word[i]);
 }
 
 
-void add_word(Dictionary *dict, const char *word) {
-    if (dict->count >= dict->capacity) {
-        dict->capacity *= 2;
-        dict->entries = realloc(dict->entries, dict->capacity * sizeof(DictEntry));
+// Computes the class and upper-case mask of a word. Only the first 64
+// characters fit in the mask; longer words are checked character by
+// character instead.
+void classify_capitalization(DictEntry *e, const char *word) {
+    int has_lower = 0, upper_count = 0;
+    e->upper_mask = 0;
+    for (size_t i = 0; i < e->len; i++) {
+        unsigned char c = word[i];
+        if (islower(c)) has_lower = 1;
+        if (isupper(c)) {
+            upper_count++;
+            if (i < 64) e->upper_mask |= (uint64_t)1 << i;
+        }
     }
-    dict->entries[dict->count].original = strdup(word);
-    dict->entries[dict->count].normalized = malloc(strlen(word) + 1);
-    normalize_word(word, dict->entries[dict->count].normalized);
+    if (upper_count == 0)
+        e->cap_class = CAP_LOWER;
+    else if (!has_lower)
+        e->cap_class = CAP_UPPER;
+    else if (upper_count == 1 && isupper((unsigned char)word[0]))
+        e->cap_class = CAP_INITIAL;
+    else
+        e->cap_class = CAP_MIXED;
+}
+
+
+void add_word(Dictionary *dict, size_t offset, size_t len) {
+    if (len > MAX_WORD_LEN - 1) len = MAX_WORD_LEN - 1;
+    DictEntry *e = &dict->entries[dict->count];
+    memset(e, 0, sizeof(DictEntry));
+    e->offset = offset;
+    e->len = len;
+    classify_capitalization(e, dict->words + offset);
+    normalize_word(dict->words + offset, len, dict->keys + offset);
     dict->count++;
 }
 
 
+int compare_keys(const char *a, size_t alen, const char *b, size_t blen) {
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    if (cmp != 0) return cmp;
+    return (alen > blen) - (alen < blen);
+}
+
+
+// qsort has no context argument, so the keys being sorted are parked here.
+static const char *sort_keys;
+
+
 int compare_entries(const void *a, const void *b) {
     const DictEntry *ea = (const DictEntry *)a;
     const DictEntry *eb = (const DictEntry *)b;
-    return strcmp(ea->normalized, eb->normalized);
+    return compare_keys(sort_keys + ea->offset, ea->len,
+                        sort_keys + eb->offset, eb->len);
+}
+
+
+void qsort_entries(DictEntry *entries, size_t n, const char *keys) {
+    sort_keys = keys;
+    qsort(entries, n, sizeof(DictEntry), compare_entries);
+}
+
+
+// Finishes small buckets of the radix sort; all keys share their first
+// depth bytes.
+void insertion_sort_entries(DictEntry *entries, size_t n, const char *keys, size_t depth) {
+    for (size_t i = 1; i < n; i++) {
+        DictEntry e = entries[i];
+        size_t j = i;
+        while (j > 0 &&
+               compare_keys(keys + entries[j - 1].offset + depth, entries[j - 1].len - depth,
+                            keys + e.offset + depth, e.len - depth) > 0) {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = e;
+    }
+}
+
+
+// MSD radix sort on the byte of each key at depth. Bucket 0 holds keys
+// that end before depth, so it needs no further sorting. The bytes are
+// gathered into digits first, so the key text is read once per level and
+// the counting and scattering passes run over contiguous arrays.
+void radix_sort_entries(DictEntry *entries, DictEntry *tmp, uint16_t *digits, size_t n,
+                        const char *keys, size_t depth) {
+    while (n > RADIX_CUTOFF) {
+        uint32_t counts[257] = { 0 };
+        for (size_t i = 0; i < n; i++) {
+            const DictEntry *e = &entries[i];
+            digits[i] = depth < e->len ? (unsigned char)keys[e->offset + depth] + 1 : 0;
+            counts[digits[i]]++;
+        }
+
+        // A shared prefix byte needs no scattering; move on to the next one.
+        if (counts[digits[0]] == n) {
+            if (digits[0] == 0) return;
+            depth++;
+            continue;
+        }
+
+        uint32_t next[257];
+        uint32_t pos = 0;
+        for (int b = 0; b < 257; b++) {
+            next[b] = pos;
+            pos += counts[b];
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[next[digits[i]]++] = entries[i];
+        memcpy(entries, tmp, n * sizeof(DictEntry));
+
+        size_t begin = counts[0];
+        for (int b = 1; b < 257; b++) {
+            if (counts[b] > 1)
+                radix_sort_entries(entries + begin, tmp, digits, counts[b], keys, depth + 1);
+            begin += counts[b];
+        }
+        return;
+    }
+    insertion_sort_entries(entries, n, keys, depth);
 }
 
 
 void sort_dictionary(Dictionary *dict) {
-    qsort(dict->entries, dict->count, sizeof(DictEntry), compare_entries);
+    PhaseTime start = phase_start();
+    DictEntry *tmp = malloc(dict->count * sizeof(DictEntry) + 1);
+    uint16_t *digits = malloc(dict->count * sizeof(uint16_t) + 1);
+    radix_sort_entries(dict->entries, tmp, digits, dict->count, dict->keys, 0);
+    free(tmp);
+    free(digits);
+    phase_end(&run_stats.phases[PHASE_SORT_DICTIONARY], start);
 }
 
 
 void free_dictionary(Dictionary *dict) {
+    for (int i = 0; i < dict->overlay_count; i++) free_dictionary(dict->overlays[i]);
+    free(dict->overlays);
+    if (dict->mapped)
+        munmap((void *)dict->data, dict->size);
+    else
+        free((void *)dict->data);
+    Arena arena = dict->arena;
+    arena_free(&arena);
+}
+
+
+// Fallback for dictionaries that cannot be mapped (pipes, terminals).
+int read_dictionary_text(Dictionary *dict, int fd) {
+    size_t capacity = READ_BUFFER_SIZE;
+    char *text = malloc(capacity);
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(fd, text + dict->size, capacity - dict->size)) > 0) {
+        dict->size += bytes_read;
+        if (dict->size == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    dict->data = text;
+    dict->words = text;
+    return bytes_read < 0 ? -1 : 0;
+}
+
+
+int is_line_break(char c) {
+    return c == '\n' || c == '\r';
+}
+
+
+// Sizes the entry array exactly with a counting pass, so that indexing
+// never has to grow it.
+void index_dictionary(Dictionary *dict) {
+    const char *text = dict->words;
+    size_t start = 0;
+    int count = 0;
+
+    for (size_t i = 0; i < dict->size; i++)
+        if (!is_line_break(text[i]) && (i == 0 || is_line_break(text[i - 1])))
+            count++;
+    dict->capacity = count;
+    dict->entries = arena_alloc(&dict->arena, count * sizeof(DictEntry));
+    dict->keys = arena_alloc(&dict->arena, dict->size + 1);
+    for (size_t i = 0; i < dict->size; i++) {
+        if (is_line_break(text[i])) {
+            if (i > start) add_word(dict, start, i - start);
+            start = i + 1;
+        }
+    }
+    if (dict->size > start) add_word(dict, start, dict->size - start);
+}
+
+
+// Points the dictionary at the index stored in a compiled file. Returns 1 if
+// the text is a compiled dictionary, 0 if it is a plain word list and -1 if
+// it is a compiled dictionary that cannot be used. Every entry and slot is
+// checked once here, so that a damaged file cannot make lookups read
+// outside it.
+int attach_compiled_dictionary(Dictionary *dict) {
+    SpdHeader header;
+    if (dict->size < sizeof(header) || memcmp(dict->data, SPD_MAGIC, 4) != 0)
+        return 0;
+    memcpy(&header, dict->data, sizeof(header));
+    if (header.version != SPD_VERSION) return -1;
+
+    // The sections must come in order within the file. Each offset is
+    // compared before it is subtracted from, so nothing can wrap around.
+    uint64_t entries_end = sizeof(header) + (uint64_t)header.count * sizeof(DictEntry);
+    if (entries_end > header.slots_offset || header.slots_offset > header.buckets_offset ||
+        header.buckets_offset > header.deletes_offset ||
+        header.deletes_offset > header.words_offset ||
+        header.words_offset > header.keys_offset || header.keys_offset > dict->size ||
+        header.slots_offset % sizeof(uint32_t) != 0 ||
+        (uint64_t)header.slot_count * sizeof(HashSlot) >
+            header.buckets_offset - header.slots_offset ||
+        header.text_size > header.keys_offset - header.words_offset ||
+        header.text_size > dict->size - header.keys_offset ||
+        (header.slot_count & (header.slot_count - 1)) != 0)
+        return -1;
+    // Only the bounds of the delete index are checked here; it is too large
+    // to read through on every load, so lookups check what they read.
+    if (header.delete_bits == 0 ? header.delete_count != 0
+        : header.delete_bits < 8 || header.delete_bits > 30 ||
+          header.buckets_offset % sizeof(uint64_t) != 0 ||
+          header.deletes_offset % sizeof(uint64_t) != 0 ||
+          (((uint64_t)1 << header.delete_bits) + 1) * sizeof(uint64_t) >
+              header.deletes_offset - header.buckets_offset ||
+          header.delete_count > (header.words_offset - header.deletes_offset) / sizeof(uint64_t))
+        return -1;
+    const DictEntry *entries = (const DictEntry *)(dict->data + sizeof(header));
+    for (uint32_t i = 0; i < header.count; i++)
+        if ((uint64_t)entries[i].offset + entries[i].len > header.text_size ||
+            entries[i].len >= MAX_WORD_LEN || entries[i].cap_class > CAP_MIXED)
+            return -1;
+    // build_hash_index fills at most half of the slots.
+    const HashSlot *slots = (const HashSlot *)(dict->data + header.slots_offset);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < header.slot_count; i++) {
+        if (slots[i].count == 0) continue;
+        if ((uint64_t)slots[i].first + slots[i].count > header.count) return -1;
+        used++;
+    }
+    if ((uint64_t)used * 2 > header.slot_count) return -1;
+
+    dict->entries = (DictEntry *)(dict->data + sizeof(header));
+    dict->count = header.count;
+    dict->capacity = header.count;
+    if (header.slot_count) {
+        dict->slots = (HashSlot *)(dict->data + header.slots_offset);
+        dict->slot_mask = header.slot_count - 1;
+    }
+    dict->words = dict->data + header.words_offset;
+    dict->keys = (char *)(dict->data + header.keys_offset);
+    dict->compiled = 1;
+    return 1;
+}
+
+
+// Points a compiled dictionary at the delete index stored with it, which
+// attach_compiled_dictionary has checked the bounds of. Returns whether it
+// has one.
+int attach_suggestion_index(Dictionary *dict) {
+    SpdHeader header;
+    memcpy(&header, dict->data, sizeof(header));
+    if (header.delete_bits == 0) return 0;
+    dict->delete_buckets = (uint64_t *)(dict->data + header.buckets_offset);
+    dict->deletes = (uint64_t *)(dict->data + header.deletes_offset);
+    dict->delete_count = header.delete_count;
+    dict->delete_shift = 64 - header.delete_bits;
+    return 1;
+}
+
+
+// Writes the sorted index, and the hash and delete indexes if they have been
+// built, as a compiled dictionary. The words of all entries are packed into fresh blobs
+// so that line breaks are not carried over. The file is written beside the
+// target and renamed over it, as the target may be mapped by this or
+// another process, even as the dictionary being compiled.
+int compile_dictionary(const Dictionary *dict, const char *filename) {
+    char tmp_path[PATH_BUFFER_SIZE];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", filename) >= sizeof(tmp_path)) {
+        fprintf(stderr, "Error: Cannot create '%s'\n", filename);
+        return 1;
+    }
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create '%s'\n", tmp_path);
+        return 1;
+    }
+
+    SpdHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPD_MAGIC, 4);
+    header.version = SPD_VERSION;
+    header.count = dict->count;
+    for (int i = 0; i < dict->count; i++)
+        header.text_size += dict->entries[i].len;
+    header.slot_count = dict->slots ? dict->slot_mask + 1 : 0;
+    header.slots_offset = sizeof(header) + (uint64_t)dict->count * sizeof(DictEntry);
+    uint64_t slots_end = header.slots_offset + (uint64_t)header.slot_count * sizeof(HashSlot);
+    header.buckets_offset = (slots_end + 7) & ~(uint64_t)7;
+    header.delete_bits = dict->deletes ? 64 - dict->delete_shift : 0;
+    size_t bucket_count = dict->deletes ? ((size_t)1 << header.delete_bits) + 1 : 0;
+    header.deletes_offset = header.buckets_offset + bucket_count * sizeof(uint64_t);
+    header.delete_count = dict->deletes ? dict->delete_count : 0;
+    header.words_offset = header.deletes_offset + header.delete_count * sizeof(uint64_t);
+    header.keys_offset = header.words_offset + header.text_size;
+
+    fwrite(&header, sizeof(header), 1, out);
+    uint32_t offset = 0;
     for (int i = 0; i < dict->count; i++) {
-        free(dict->entries[i].original);
-        free(dict->entries[i].normalized);
+        DictEntry e = dict->entries[i];
+        e.offset = offset;
+        fwrite(&e, sizeof(e), 1, out);
+        offset += e.len;
+    }
+    fwrite(dict->slots, sizeof(HashSlot), header.slot_count, out);
+    static const char padding[8];
+    fwrite(padding, 1, header.buckets_offset - slots_end, out);
+    fwrite(dict->delete_buckets, sizeof(uint64_t), bucket_count, out);
+    fwrite(dict->deletes, sizeof(uint64_t), header.delete_count, out);
+    for (int i = 0; i < dict->count; i++)
+        fwrite(dict->words + dict->entries[i].offset, 1, dict->entries[i].len, out);
+    for (int i = 0; i < dict->count; i++)
+        fwrite(dict->keys + dict->entries[i].offset, 1, dict->entries[i].len, out);
+
+    if (ferror(out) | fclose(out) || rename(tmp_path, filename) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", filename);
+        unlink(tmp_path);
+        return 1;
     }
-    free(dict->entries);
-    free(dict);
+    return 0;
 }
 
 
@@ -92,41 +836,172 @@ Dictionary *load_dictionary(const char *filename) {
 
 
     Dictionary *dict = create_dictionary();
-    char buffer[BUFFER_SIZE];
-    char word[MAX_WORD_LEN];
-    int word_len = 0;
-    ssize_t bytes_read;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if ((uint64_t)st.st_size > UINT32_MAX) {
+            fprintf(stderr, "Error: Dictionary file '%s' is too large\n", filename);
+            close(fd);
+            free_dictionary(dict);
+            return NULL;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            // All of a word list is indexed right away, and a compiled
+            // dictionary is probed all over, so start reading it in now.
+            posix_madvise(map, st.st_size, POSIX_MADV_WILLNEED);
+            dict->data = map;
+            dict->words = map;
+            dict->size = st.st_size;
+            dict->mapped = 1;
+        }
+    }
+    if (!dict->mapped && read_dictionary_text(dict, fd) < 0) {
+        fprintf(stderr, "Error: Cannot read dictionary file '%s'\n", filename);
+        close(fd);
+        free_dictionary(dict);
+        return NULL;
+    }
 
 
-    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        for (ssize_t i = 0; i < bytes_read; i++) {
-            char c = buffer[i];
-            if (c == '\n' || c == '\r') {
-                if (word_len > 0) {
-                    word[word_len] = '\0';
-                    add_word(dict, word);
-                    word_len = 0;
-                }
-            } else if (word_len < MAX_WORD_LEN - 1) {
-                word[word_len++] = c;
-            }
-        }
+    close(fd);
+    switch (attach_compiled_dictionary(dict)) {
+    case 1:
+        break;
+    case 0:
+        index_dictionary(dict);
+        sort_dictionary(dict);
+        break;
+    default:
+        fprintf(stderr, "Error: Dictionary file '%s' has an unsupported format; recompile it\n",
+                filename);
+        free_dictionary(dict);
+        return NULL;
     }
+    return dict;
+}
 
 
-    if (word_len > 0) {
-        word[word_len] = '\0';
-        add_word(dict, word);
+// Layers overlay over dict, which takes it over. Overlays are kept in order
+// of size.
+void add_overlay(Dictionary *dict, Dictionary *overlay) {
+    dict->overlays = realloc(dict->overlays, (dict->overlay_count + 1) * sizeof(Dictionary *));
+    int i = dict->overlay_count++;
+    while (i > 0 && dict->overlays[i - 1]->count > overlay->count) {
+        dict->overlays[i] = dict->overlays[i - 1];
+        i--;
     }
+    dict->overlays[i] = overlay;
+}
 
 
-    close(fd);
-    sort_dictionary(dict);
-    return dict;
+// Lower-cases ASCII letters the way tolower() does in the C locale, so that
+// lookups can normalize words on the fly instead of copying them.
+static inline unsigned char fold_case(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+
+// Hash of the normalized form of key; key itself may be in any case.
+uint32_t hash_key(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= fold_case(key[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Builds the open-addressing index over the sorted entries, one slot per
+// distinct key, at a load factor of at most one half. Compiled dictionaries
+// come with the index already built.
+void build_hash_index(Dictionary *dict) {
+    if (dict->slots) return;
+    uint32_t size = 16;
+    while (size < (uint32_t)dict->count * 2) size *= 2;
+    dict->slots = arena_alloc(&dict->arena, size * sizeof(HashSlot));
+    memset(dict->slots, 0, size * sizeof(HashSlot));
+    dict->slot_mask = size - 1;
+
+    int i = 0;
+    while (i < dict->count) {
+        const DictEntry *e = &dict->entries[i];
+        const char *key = dict->keys + e->offset;
+        int j = i + 1;
+        while (j < dict->count &&
+               compare_keys(key, e->len, dict->keys + dict->entries[j].offset,
+                            dict->entries[j].len) == 0)
+            j++;
+
+        uint32_t hash = hash_key(key, e->len);
+        uint32_t slot = hash & dict->slot_mask;
+        while (dict->slots[slot].count != 0) slot = (slot + 1) & dict->slot_mask;
+        dict->slots[slot].hash = hash;
+        dict->slots[slot].first = i;
+        dict->slots[slot].count = j - i;
+        i = j;
+    }
+}
+
+
+// The blocked Bloom filter keeps each key's bits in one 32-byte block, one
+// bit in each of its eight 32-bit words, so a test touches a single cache
+// line. The block comes from the top half of a 64-bit mix of the key hash
+// and the bit positions from multiplying the bottom half by fixed odd
+// salts, as in Impala's split block filter.
+const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+
+static inline uint32_t *bloom_block(const Dictionary *dict, uint32_t hash, uint32_t *bits) {
+    uint64_t mixed = hash * 0x9e3779b97f4a7c15ull;
+    *bits = (uint32_t)mixed;
+    return dict->bloom + ((mixed >> 32) * dict->bloom_blocks >> 32) * BLOOM_BLOCK_WORDS;
+}
+
+
+static inline int bloom_may_contain(const Dictionary *dict, uint32_t hash) {
+    uint32_t bits;
+    const uint32_t *block = bloom_block(dict, hash, &bits);
+    uint32_t missing = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        missing |= ~block[i] & (1u << ((bits * bloom_salts[i]) >> 27));
+    return missing == 0;
+}
+
+
+// Adds every distinct key to a filter of about bits_per_key bits per key.
+void build_bloom_filter(Dictionary *dict, int bits_per_key) {
+    uint32_t keys = 0;
+    for (int i = 0; i < dict->count; i++)
+        keys += i == 0 || compare_keys(dict->keys + dict->entries[i - 1].offset,
+                                       dict->entries[i - 1].len,
+                                       dict->keys + dict->entries[i].offset,
+                                       dict->entries[i].len) != 0;
+    uint64_t blocks = ((uint64_t)keys * bits_per_key + 32 * BLOOM_BLOCK_WORDS - 1) /
+                      (32 * BLOOM_BLOCK_WORDS);
+    dict->bloom_blocks = blocks ? blocks : 1;
+    size_t size = (size_t)dict->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+    uintptr_t start = (uintptr_t)arena_alloc(&dict->arena, size + 63);
+    dict->bloom = (uint32_t *)((start + 63) & ~(uintptr_t)63);
+    memset(dict->bloom, 0, size);
+
+    for (int i = 0; i < dict->count; i++) {
+        uint32_t bits;
+        uint32_t *block = bloom_block(dict, hash_key(dict->keys + dict->entries[i].offset,
+                                                     dict->entries[i].len), &bits);
+        for (int j = 0; j < BLOOM_BLOCK_WORDS; j++)
+            block[j] |= 1u << ((bits * bloom_salts[j]) >> 27);
+    }
 }
-int is_valid_capitalization(const char *dict_word, const char *input_word) {
-    size_t len = strlen(dict_word);  // Change int to size_t
-    if (len != strlen(input_word)) return 0;
+
+
+int is_valid_capitalization(const char *dict_word, size_t dict_len,
+                            const char *input_word, size_t input_len) {
+    size_t len = dict_len;
+    if (len != input_len) return 0;
     int dict_has_lowercase = 0;
     int dict_has_uppercase = 0;
     for (size_t i = 0; i < len; i++) {  // Also change i to size_t
@@ -162,15 +1037,28 @@ int is_valid_capitalization(const char *dict_word, const char *input_word) {
 }
 
 
-int word_in_dictionary(Dictionary *dict, const char *word) {
-    char normalized[MAX_WORD_LEN];
-    normalize_word(word, normalized);
+// Compares a word, normalized on the fly, with a dictionary key.
+int compare_folded(const char *word, size_t wlen, const char *key, size_t klen) {
+    size_t n = wlen < klen ? wlen : klen;
+    for (size_t i = 0; i < n; i++) {
+        int diff = fold_case(word[i]) - (unsigned char)key[i];
+        if (diff != 0) return diff;
+    }
+    return (wlen > klen) - (wlen < klen);
+}
+
+
+// The find_run functions locate the run of entries whose key is the
+// normalized form of key, which may be in any case. They return the length
+// of the run and store the index of its first entry in *first.
+int find_run_sorted(const Dictionary *dict, const char *key, size_t len, int *first) {
     int left = 0, right = dict->count - 1;
     int found_idx = -1;
    
     while (left <= right) {
         int mid = left + (right - left) / 2;
-        int cmp = strcmp(normalized, dict->entries[mid].normalized);
+        const DictEntry *e = &dict->entries[mid];
+        int cmp = compare_folded(key, len, dict->keys + e->offset, e->len);
         if (cmp == 0) {
             found_idx = mid;
             break;
@@ -183,153 +1071,2083 @@ int word_in_dictionary(Dictionary *dict, const char *word) {
         return 0;
     }
     int start_idx = found_idx;
-    while (start_idx > 0 && strcmp(normalized, dict->entries[start_idx - 1].normalized) == 0) {
+    while (start_idx > 0 &&
+           compare_folded(key, len, dict->keys + dict->entries[start_idx - 1].offset,
+                        dict->entries[start_idx - 1].len) == 0) {
         start_idx--;
     }
-    int idx = start_idx;
-    while (idx < dict->count && strcmp(normalized, dict->entries[idx].normalized) == 0) {
-        if (is_valid_capitalization(dict->entries[idx].original, word)) {
-            return 1;
-        }
-        idx++;
+    int end_idx = found_idx + 1;
+    while (end_idx < dict->count &&
+           compare_folded(key, len, dict->keys + dict->entries[end_idx].offset,
+                        dict->entries[end_idx].len) == 0) {
+        end_idx++;
     }
-   
-    return 0;
+    *first = start_idx;
+    return end_idx - start_idx;
 }
 
 
-int is_all_digits_or_symbols(const char *word) {
-    for (int i = 0; word[i]; i++) {
-        if (isalpha((unsigned char)word[i])) return 0;
+// hash is hash_key(key, len). The probe stops after a full lap of the
+// table, which only a damaged one could need.
+int find_run_hashed(const Dictionary *dict, const char *key, size_t len, uint32_t hash,
+                    int *first) {
+    uint32_t i = hash & dict->slot_mask;
+    for (uint32_t probes = 0; probes <= dict->slot_mask; probes++, i = (i + 1) & dict->slot_mask) {
+        const HashSlot *slot = &dict->slots[i];
+        if (slot->count == 0) return 0;
+        const DictEntry *e = &dict->entries[slot->first];
+        if (slot->hash == hash && e->len == len &&
+            compare_folded(key, len, dict->keys + e->offset, len) == 0) {
+            *first = slot->first;
+            return slot->count;
+        }
     }
-    return 1;
+    return 0;
 }
 
 
-const char *strip_leading_punctuation(const char *word) {
-    while (*word && strchr("([{\'\"", *word)) word++;
-    return word;
+// Growable arrays of the trie under construction.
+typedef struct {
+    uint32_t *nodes;
+    uint32_t *counts;
+    size_t node_count;
+    size_t node_capacity;
+    uint8_t *labels;
+    uint32_t *targets;
+    uint32_t *ranks;
+    size_t edge_count;
+    size_t edge_capacity;
+    uint32_t *registry;
+    size_t registry_mask;
+} TrieBuilder;
+
+
+// A node on the path of the last key added. Its edges are final except the
+// last one, which leads to the next node on the path.
+typedef struct {
+    int terminal;
+    int edge_count;
+    uint8_t labels[256];
+    uint32_t targets[256];
+} PathNode;
+
+
+uint32_t hash_trie_node(int terminal, const uint8_t *labels, const uint32_t *targets, int n) {
+    uint32_t hash = 2166136261u ^ terminal;
+    for (int i = 0; i < n; i++) {
+        hash = (hash ^ labels[i]) * 16777619u;
+        hash = (hash ^ targets[i]) * 16777619u;
+    }
+    return hash;
 }
 
 
-void strip_trailing_punctuation(char *word) {
-    int len = strlen(word);
-    while (len > 0 && !isalnum((unsigned char)word[len - 1])) len--;
-    word[len] = '\0';
+uint32_t trie_node_edges(const uint32_t *nodes, uint32_t id, uint32_t *end) {
+    *end = nodes[id + 1] & ~TRIE_TERMINAL;
+    return nodes[id] & ~TRIE_TERMINAL;
 }
 
 
-void check_word(Dictionary *dict, const char *word, const char *filename,
-                int line, int col, int *error_found) {
-    if (strlen(word) == 0) return;
-    if (is_all_digits_or_symbols(word)) return;
-
-
-    char processed[MAX_WORD_LEN];
-    const char *stripped = strip_leading_punctuation(word);
-    strcpy(processed, stripped);
-    strip_trailing_punctuation(processed);
-
-
-    if (strlen(processed) == 0 || is_all_digits_or_symbols(processed)) return;
+void registry_insert(TrieBuilder *b, uint32_t id) {
+    uint32_t start, end;
+    start = trie_node_edges(b->nodes, id, &end);
+    uint32_t hash = hash_trie_node((b->nodes[id] & TRIE_TERMINAL) != 0, b->labels + start,
+                                   b->targets + start, end - start);
+    size_t slot = hash & b->registry_mask;
+    while (b->registry[slot] != UINT32_MAX) slot = (slot + 1) & b->registry_mask;
+    b->registry[slot] = id;
+}
 
 
-    if (!word_in_dictionary(dict, processed)) {
-        if (filename)
-            printf("%s:%d:%d %s\n", filename, line, col, processed);
-        else
-            printf("%d:%d %s\n", line, col, processed);
-        *error_found = 1;
+// Returns the id of a node equal to node, adding node to the trie if there
+// is none yet. Equal nodes have the same terminal flag and the same edges
+// to the same children, which are themselves already unique.
+uint32_t freeze_node(TrieBuilder *b, const PathNode *node) {
+    uint32_t hash = hash_trie_node(node->terminal, node->labels, node->targets,
+                                   node->edge_count);
+    size_t slot = hash & b->registry_mask;
+    for (; b->registry[slot] != UINT32_MAX; slot = (slot + 1) & b->registry_mask) {
+        uint32_t id = b->registry[slot];
+        uint32_t start, end;
+        start = trie_node_edges(b->nodes, id, &end);
+        if (((b->nodes[id] & TRIE_TERMINAL) != 0) == node->terminal &&
+            end - start == (uint32_t)node->edge_count &&
+            memcmp(b->labels + start, node->labels, node->edge_count) == 0 &&
+            memcmp(b->targets + start, node->targets, node->edge_count * sizeof(uint32_t)) == 0)
+            return id;
     }
-}
 
+    if (b->node_count + 2 > b->node_capacity) {
+        b->node_capacity *= 2;
+        b->nodes = realloc(b->nodes, b->node_capacity * sizeof(uint32_t));
+        b->counts = realloc(b->counts, b->node_capacity * sizeof(uint32_t));
+    }
+    if (b->edge_count + node->edge_count > b->edge_capacity) {
+        while (b->edge_count + node->edge_count > b->edge_capacity) b->edge_capacity *= 2;
+        b->labels = realloc(b->labels, b->edge_capacity);
+        b->targets = realloc(b->targets, b->edge_capacity * sizeof(uint32_t));
+        b->ranks = realloc(b->ranks, b->edge_capacity * sizeof(uint32_t));
+    }
 
-int check_file(Dictionary *dict, const char *filename, int show_filename) {
-    int fd = (filename == NULL) ? STDIN_FILENO : open(filename, O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
-        return 1;
+    // Ranks number the keys below each edge: a key's index is the sum of
+    // the ranks along its path.
+    uint32_t id = b->node_count++;
+    uint32_t rank = node->terminal;
+    b->nodes[id] = b->edge_count | (node->terminal ? TRIE_TERMINAL : 0);
+    for (int i = 0; i < node->edge_count; i++) {
+        b->labels[b->edge_count] = node->labels[i];
+        b->targets[b->edge_count] = node->targets[i];
+        b->ranks[b->edge_count] = rank;
+        rank += b->counts[node->targets[i]];
+        b->edge_count++;
     }
+    b->counts[id] = rank;
+    b->nodes[id + 1] = b->edge_count;
+
+    if (b->node_count * 2 > b->registry_mask) {
+        free(b->registry);
+        b->registry_mask = b->registry_mask * 2 + 1;
+        b->registry = malloc((b->registry_mask + 1) * sizeof(uint32_t));
+        memset(b->registry, 0xff, (b->registry_mask + 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < b->node_count; i++) registry_insert(b, i);
+    } else {
+        registry_insert(b, id);
+    }
+    return id;
+}
 
 
-    char buffer[BUFFER_SIZE];
-    char word[MAX_WORD_LEN];
-    int word_len = 0, line = 1, col = 1, word_col = 1;
-    ssize_t bytes_read;
-    int error_found = 0;
+// Freezes the path below depth, leaving path[depth] with final edges only.
+void freeze_path(TrieBuilder *b, PathNode *path, int from, int depth) {
+    for (int d = from; d > depth; d--)
+        path[d - 1].targets[path[d - 1].edge_count - 1] = freeze_node(b, &path[d]);
+}
 
 
-    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        for (ssize_t i = 0; i < bytes_read; i++) {
-            char c = buffer[i];
+void *arena_copy(Arena *arena, const void *data, size_t size) {
+    void *copy = arena_alloc(arena, size + 1);
+    memcpy(copy, data, size);
+    return copy;
+}
 
 
-            if (isspace((unsigned char)c)) {
-                if (word_len > 0) {
-                    word[word_len] = '\0';
-                    check_word(dict, word, show_filename ? filename : NULL,
-                               line, word_col, &error_found);
-                    word_len = 0;
-                }
-                if (c == '\n') {
-                    line++;
-                    col = 1;
-                } else {
-                    col++;
-                }
-            } else {
-                if (word_len == 0) word_col = col;
-                if (word_len < MAX_WORD_LEN - 1) word[word_len++] = c;
-                col++;
-            }
+// Builds a dictionary that keeps the distinct keys as a minimized DAWG
+// (Daciuk et al.'s incremental construction over sorted keys) instead of
+// text, and frees dict. Walking a key's path numbers it among the keys;
+// the number picks its run of case variants, which keep only their
+// capitalization class and mask. Words longer than 64 characters also
+// keep their text, as the mask does not cover them.
+Dictionary *build_trie_dictionary(Dictionary *dict) {
+    TrieBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.node_capacity = 1024;
+    b.nodes = malloc(b.node_capacity * sizeof(uint32_t));
+    b.counts = malloc(b.node_capacity * sizeof(uint32_t));
+    b.edge_capacity = 1024;
+    b.labels = malloc(b.edge_capacity);
+    b.targets = malloc(b.edge_capacity * sizeof(uint32_t));
+    b.ranks = malloc(b.edge_capacity * sizeof(uint32_t));
+    b.registry_mask = 1023;
+    b.registry = malloc((b.registry_mask + 1) * sizeof(uint32_t));
+    memset(b.registry, 0xff, (b.registry_mask + 1) * sizeof(uint32_t));
+    b.nodes[0] = 0;
+
+    Dictionary *trie_dict = create_dictionary();
+    Trie *trie = arena_alloc(&trie_dict->arena, sizeof(Trie));
+    memset(trie, 0, sizeof(Trie));
+    trie->run_starts = arena_alloc(&trie_dict->arena, (dict->count + 1) * sizeof(uint32_t));
+
+    PathNode *path = calloc(MAX_WORD_LEN + 1, sizeof(PathNode));
+    const char *prev = NULL;
+    int prev_len = 0;
+    uint32_t key_count = 0;
+    for (int i = 0; i < dict->count; i++) {
+        const DictEntry *e = &dict->entries[i];
+        const char *key = dict->keys + e->offset;
+        if (prev && compare_keys(prev, prev_len, key, e->len) == 0) continue;
+        trie->run_starts[key_count++] = i;
+
+        int common = 0;
+        while (common < prev_len && common < e->len && prev[common] == key[common]) common++;
+        freeze_path(&b, path, prev_len, common);
+        for (int d = common; d < e->len; d++) {
+            PathNode *node = &path[d];
+            node->labels[node->edge_count] = key[d];
+            node->targets[node->edge_count++] = 0;
+            path[d + 1].terminal = 0;
+            path[d + 1].edge_count = 0;
+        }
+        path[e->len].terminal = 1;
+        prev = key;
+        prev_len = e->len;
+    }
+    trie->run_starts[key_count] = dict->count;
+    freeze_path(&b, path, prev_len, 0);
+    trie->root = freeze_node(&b, &path[0]);
+    free(path);
+
+    Arena *arena = &trie_dict->arena;
+    trie->nodes = arena_copy(arena, b.nodes, (b.node_count + 1) * sizeof(uint32_t));
+    trie->labels = arena_copy(arena, b.labels, b.edge_count);
+    trie->edges = arena_alloc(arena, b.edge_count * sizeof(uint64_t) + 1);
+    for (size_t i = 0; i < b.edge_count; i++)
+        trie->edges[i] = (uint64_t)b.ranks[i] << 32 | b.targets[i];
+    trie->node_count = b.node_count;
+    trie->edge_count = b.edge_count;
+    free(b.nodes);
+    free(b.counts);
+    free(b.labels);
+    free(b.targets);
+    free(b.ranks);
+    free(b.registry);
+
+    trie->cap_classes = arena_alloc(arena, dict->count + 1);
+    size_t long_text_size = 0;
+    for (int i = 0; i < dict->count; i++) {
+        trie->cap_classes[i] = dict->entries[i].cap_class;
+        trie->mixed_count += dict->entries[i].cap_class == CAP_MIXED;
+        if (dict->entries[i].len > 64) {
+            trie->long_count++;
+            long_text_size += dict->entries[i].len;
         }
     }
+    trie->mixed_variants = arena_alloc(arena, trie->mixed_count * sizeof(uint32_t) + 1);
+    trie->mixed_masks = arena_alloc(arena, trie->mixed_count * sizeof(uint64_t) + 1);
+    uint32_t mixed = 0;
+    for (int i = 0; i < dict->count; i++) {
+        if (dict->entries[i].cap_class != CAP_MIXED) continue;
+        trie->mixed_variants[mixed] = i;
+        trie->mixed_masks[mixed++] = dict->entries[i].upper_mask;
+    }
+    trie->long_variants = arena_alloc(arena, trie->long_count * sizeof(uint32_t) + 1);
+    trie->long_offsets = arena_alloc(arena, trie->long_count * sizeof(uint32_t) + 1);
+    trie->long_text = arena_alloc(arena, long_text_size + 1);
+    uint32_t n = 0, offset = 0;
+    for (int i = 0; i < dict->count; i++) {
+        const DictEntry *e = &dict->entries[i];
+        if (e->len <= 64) continue;
+        trie->long_variants[n] = i;
+        trie->long_offsets[n++] = offset;
+        memcpy(trie->long_text + offset, dict->words + e->offset, e->len);
+        offset += e->len;
+    }
+
+    if (dict->bloom) {
+        size_t size = (size_t)dict->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+        uintptr_t start = (uintptr_t)arena_alloc(arena, size + 63);
+        trie_dict->bloom = (uint32_t *)((start + 63) & ~(uintptr_t)63);
+        memcpy(trie_dict->bloom, dict->bloom, size);
+        trie_dict->bloom_blocks = dict->bloom_blocks;
+    }
+    trie_dict->count = dict->count;
+    trie_dict->trie = trie;
+    free_dictionary(dict);
+    return trie_dict;
+}
 
 
-    if (word_len > 0) {
-        word[word_len] = '\0';
-        check_word(dict, word, show_filename ? filename : NULL,
-                   line, word_col, &error_found);
+// Position of variant in a sorted list of variant numbers that holds it.
+uint32_t find_variant(const uint32_t *variants, uint32_t count, int variant) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (variants[mid] < (uint32_t)variant) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
 
-    if (filename != NULL) close(fd);
-    return error_found;
+// The text of a word longer than 64 characters, by its variant number.
+const char *trie_long_word(const Trie *trie, int variant) {
+    return trie->long_text + trie->long_offsets[find_variant(trie->long_variants,
+                                                             trie->long_count, variant)];
 }
 
 
-int check_directory(Dictionary *dict, const char *path, const char *suffix, int *error_found) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        fprintf(stderr, "Error: Cannot open directory '%s'\n", path);
-        return 1;
+// The upper-case mask of a variant. Only mixed-case words store theirs:
+// the others follow from the class, given the letters of the matching
+// input word, which are those of the variant.
+uint64_t trie_upper_mask(const Trie *trie, int variant, uint64_t letters) {
+    switch (trie->cap_classes[variant]) {
+    case CAP_LOWER: return 0;
+    case CAP_INITIAL: return 1;
+    case CAP_UPPER: return letters;
+    default:
+        return trie->mixed_masks[find_variant(trie->mixed_variants, trie->mixed_count, variant)];
     }
+}
 
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
+int find_run_trie(const Trie *trie, const char *key, size_t len, int *first) {
+    uint32_t node = trie->root;
+    uint32_t index = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = fold_case(key[i]);
+        uint32_t end;
+        uint32_t edge = trie_node_edges(trie->nodes, node, &end);
+        while (edge < end && trie->labels[edge] < c) edge++;
+        if (edge == end || trie->labels[edge] != c) return 0;
+        index += trie->edges[edge] >> 32;
+        node = (uint32_t)trie->edges[edge];
+    }
+    if (!(trie->nodes[node] & TRIE_TERMINAL)) return 0;
+    *first = trie->run_starts[index];
+    return trie->run_starts[index + 1] - *first;
+}
 
 
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
+// The precomputed form of is_valid_capitalization. Every upper-case letter
+// of the dictionary word must be upper case in the input, and a word that
+// mixes cases may not be written in all capitals. The letters themselves
+// already match, since the normalized keys are equal.
+int capitalization_matches(int cap_class, uint64_t upper_mask, uint64_t input_upper,
+                           int input_has_lower) {
+    if ((cap_class == CAP_INITIAL || cap_class == CAP_MIXED) && !input_has_lower)
+        return 0;
+    return (upper_mask & ~input_upper) == 0;
+}
 
 
-        struct stat st;
-        if (stat(fullpath, &st) != 0) continue;
+// One layer's part of word_in_dictionary, given the hash of the key.
+// Finds the run of key with whichever index the layer has. hash is
+// hash_key(key, len).
+int find_run(const Dictionary *dict, const char *key, size_t len, uint32_t hash, int *first) {
+    if (dict->trie) return find_run_trie(dict->trie, key, len, first);
+    if (dict->slots) return find_run_hashed(dict, key, len, hash, first);
+    return find_run_sorted(dict, key, len, first);
+}
 
 
-        if (S_ISDIR(st.st_mode)) {
-            check_directory(dict, fullpath, suffix, error_found);
-        } else if (S_ISREG(st.st_mode)) {
-            int name_len = strlen(entry->d_name);
-            int suffix_len = strlen(suffix);
-            if (name_len >= suffix_len &&
-                strcmp(entry->d_name + name_len - suffix_len, suffix) == 0) {
-                if (check_file(dict, fullpath, 1))
-                    *error_found = 1;
-            }
+int word_in_layer(const Dictionary *dict, const char *word, size_t len, uint32_t hash,
+                  Stats *stats) {
+    if (dict->bloom && !bloom_may_contain(dict, hash)) {
+        if (stats) stats->counters[STAT_BLOOM_REJECTS]++;
+        return 0;
+    }
+
+    int first;
+    int count = find_run(dict, word, len, hash, &first);
+    if (count == 0) return 0;
+
+    if (len > 64) {
+        for (int idx = first; idx < first + count; idx++) {
+            const char *dict_word = dict->trie ? trie_long_word(dict->trie, idx)
+                                               : dict->words + dict->entries[idx].offset;
+            if (stats) stats->counters[STAT_CASE_COMPARISONS]++;
+            if (is_valid_capitalization(dict_word, len, word, len))
+                return 1;
         }
+        return 0;
+    }
+
+    uint64_t input_upper = 0, input_lower = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = word[i];
+        input_upper |= (uint64_t)(c >= 'A' && c <= 'Z') << i;
+        input_lower |= (uint64_t)(c >= 'a' && c <= 'z') << i;
+    }
+    for (int idx = first; idx < first + count; idx++) {
+        if (stats) stats->counters[STAT_CASE_COMPARISONS]++;
+        int matches = dict->trie
+            ? capitalization_matches(dict->trie->cap_classes[idx],
+                                     trie_upper_mask(dict->trie, idx, input_upper | input_lower),
+                                     input_upper, input_lower != 0)
+            : capitalization_matches(dict->entries[idx].cap_class, dict->entries[idx].upper_mask,
+                                     input_upper, input_lower != 0);
+        if (matches) return 1;
+    }
+    return 0;
+}
+
+
+// stats, when given, counts the case variants compared and the words the
+// Bloom filter rejects. The base dictionary holds nearly every correct
+// word, so it is tried first; the overlays, small enough to stay in cache,
+// only see the words it lacks.
+int word_in_dictionary(Dictionary *dict, const char *word, size_t len, Stats *stats) {
+    uint32_t hash = dict->slots || dict->bloom || dict->overlay_count ? hash_key(word, len) : 0;
+    if (word_in_layer(dict, word, len, hash, stats)) return 1;
+    for (int i = 0; i < dict->overlay_count; i++)
+        if (word_in_layer(dict->overlays[i], word, len, hash, stats)) return 1;
+    return 0;
+}
+
+
+// Calls add(ctx, hash, deleted) for the prefix itself, then for every
+// string obtained by deleting one of its characters, then two. Repeats are
+// possible when the prefix has runs of equal letters.
+void for_each_delete(const char *prefix, size_t len, void (*add)(void *, uint32_t, int),
+                     void *ctx) {
+    char buf[SUGGEST_PREFIX_LEN];
+    add(ctx, hash_key(prefix, len), 0);
+    for (size_t i = 0; i < len; i++) {
+        memcpy(buf, prefix, i);
+        memcpy(buf + i, prefix + i + 1, len - i - 1);
+        add(ctx, hash_key(buf, len - 1), 1);
+    }
+    for (size_t i = 0; i < len; i++) {
+        memcpy(buf, prefix, i);
+        memcpy(buf + i, prefix + i + 1, len - i - 1);
+        for (size_t j = i; j + 1 < len; j++) {
+            memcpy(buf + j, prefix + j + 2, len - j - 2);
+            add(ctx, hash_key(buf, len - 2), 2);
+            buf[j] = prefix[j + 1];
+        }
+    }
+}
+
+
+typedef struct {
+    uint64_t *deletes;
+    size_t count;
+    uint32_t first;
+} DeleteBuilder;
+
+
+void add_delete(void *ctx, uint32_t hash, int deleted) {
+    (void)deleted;
+    DeleteBuilder *b = ctx;
+    b->deletes[b->count++] = (uint64_t)hash << 32 | b->first;
+}
+
+
+// Builds the symmetric-delete index: for every distinct key, the hashes of
+// its prefix with up to two characters deleted, each paired with the key's
+// first entry, sorted by hash. A stable LSD radix sort on the hash keeps
+// the pairs of each hash in entry order, so repeats end up adjacent.
+// delete_buckets maps the top bits of a hash to where its pairs start, so a
+// lookup reads one short stretch of pairs instead of binary searching.
+// Dictionaries compiled with --suggest come with the index already built.
+void build_suggestion_index(Dictionary *dict) {
+    PhaseTime start = phase_start();
+    if (dict->compiled && attach_suggestion_index(dict)) {
+        phase_end(&run_stats.phases[PHASE_BUILD_SUGGESTIONS], start);
+        return;
+    }
+    size_t capacity = 0;
+    for (int i = 0; i < dict->count; i++) {
+        size_t p = dict->entries[i].len < SUGGEST_PREFIX_LEN ? dict->entries[i].len
+                                                              : SUGGEST_PREFIX_LEN;
+        capacity += 1 + p + p * (p - 1) / 2;
+    }
+    DeleteBuilder b = { arena_alloc(&dict->arena, capacity * sizeof(uint64_t) + 1), 0, 0 };
+    int i = 0;
+    while (i < dict->count) {
+        const DictEntry *e = &dict->entries[i];
+        const char *key = dict->keys + e->offset;
+        int j = i + 1;
+        while (j < dict->count &&
+               compare_keys(key, e->len, dict->keys + dict->entries[j].offset,
+                            dict->entries[j].len) == 0)
+            j++;
+        b.first = i;
+        for_each_delete(key, e->len < SUGGEST_PREFIX_LEN ? e->len : SUGGEST_PREFIX_LEN,
+                        add_delete, &b);
+        i = j;
+    }
+
+    uint64_t *tmp = malloc(b.count * sizeof(uint64_t) + 1);
+    for (int shift = 32; shift < 64; shift += 8) {
+        size_t counts[256] = { 0 };
+        for (size_t k = 0; k < b.count; k++) counts[(b.deletes[k] >> shift) & 0xff]++;
+        size_t pos = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t c = counts[d];
+            counts[d] = pos;
+            pos += c;
+        }
+        for (size_t k = 0; k < b.count; k++) tmp[counts[(b.deletes[k] >> shift) & 0xff]++] = b.deletes[k];
+        uint64_t *swap = b.deletes;
+        b.deletes = tmp;
+        tmp = swap;
+    }
+    // After an even number of passes the pairs are back in the arena.
+    free(tmp);
+
+    size_t n = 0;
+    for (size_t k = 0; k < b.count; k++)
+        if (n == 0 || b.deletes[n - 1] != b.deletes[k]) b.deletes[n++] = b.deletes[k];
+    dict->deletes = b.deletes;
+    dict->delete_count = n;
+
+    int bits = 8;
+    while (bits < 30 && ((size_t)1 << bits) < n / 4) bits++;
+    size_t bucket_count = (size_t)1 << bits;
+    dict->delete_shift = 64 - bits;
+    dict->delete_buckets = arena_alloc(&dict->arena, (bucket_count + 1) * sizeof(uint64_t));
+    size_t k = 0;
+    for (size_t bucket = 0; bucket <= bucket_count; bucket++) {
+        while (k < n && b.deletes[k] >> dict->delete_shift < bucket) k++;
+        dict->delete_buckets[bucket] = k;
+    }
+    phase_end(&run_stats.phases[PHASE_BUILD_SUGGESTIONS], start);
+}
+
+
+// Optimal string alignment distance (Levenshtein plus adjacent
+// transpositions) between a and b, or max + 1 once it must exceed max.
+int edit_distance(const char *a, size_t alen, const char *b, size_t blen, int max) {
+    if ((alen > blen ? alen - blen : blen - alen) > (size_t)max) return max + 1;
+    int rows[3][MAX_WORD_LEN + 1];
+    int *prev2 = rows[0], *prev = rows[1], *cur = rows[2];
+    for (size_t j = 0; j <= blen; j++) prev[j] = j;
+    for (size_t i = 1; i <= alen; i++) {
+        cur[0] = i;
+        int row_min = cur[0];
+        for (size_t j = 1; j <= blen; j++) {
+            int cost = a[i - 1] != b[j - 1];
+            int d = prev[j - 1] + cost;
+            if (prev[j] + 1 < d) d = prev[j] + 1;
+            if (cur[j - 1] + 1 < d) d = cur[j - 1] + 1;
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] &&
+                prev2[j - 2] + 1 < d)
+                d = prev2[j - 2] + 1;
+            cur[j] = d;
+            if (d < row_min) row_min = d;
+        }
+        if (row_min > max) return max + 1;
+        int *swap = prev2;
+        prev2 = prev;
+        prev = cur;
+        cur = swap;
+    }
+    return prev[blen] <= max ? prev[blen] : max + 1;
+}
+
+
+// A word of at most 64 characters prepared for the bit-parallel distance:
+// bit i of peq[c] is set where the word has character c at position i.
+typedef struct {
+    uint64_t peq[256];
+    size_t len;
+} MyersPattern;
+
+
+void myers_pattern(MyersPattern *p, const char *word, size_t len) {
+    memset(p->peq, 0, sizeof(p->peq));
+    for (size_t i = 0; i < len; i++) p->peq[(unsigned char)word[i]] |= (uint64_t)1 << i;
+    p->len = len;
+}
+
+
+// Optimal string alignment distance between the pattern and text, as
+// edit_distance computes it, with one column of the table in the bits of
+// VP and VN (Myers' algorithm, with Hyyro's extension to transpositions).
+// Returns max + 1 once the distance must exceed max.
+int myers_distance(const MyersPattern *p, const char *text, size_t len, int max) {
+    if ((p->len > len ? p->len - len : len - p->len) > (size_t)max) return max + 1;
+    if (p->len == 0) return len;
+    uint64_t vp = ~(uint64_t)0, vn = 0, d0 = 0, pm_prev = 0;
+    uint64_t high = (uint64_t)1 << (p->len - 1);
+    long distance = p->len;
+    for (size_t j = 0; j < len; j++) {
+        uint64_t pm = p->peq[(unsigned char)text[j]];
+        uint64_t tr = ((~d0 & pm) << 1) & pm_prev;
+        d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+        uint64_t hp = vn | ~(d0 | vp);
+        uint64_t hn = d0 & vp;
+        distance += (hp & high) != 0;
+        distance -= (hn & high) != 0;
+        // Each remaining character can lower the distance by one at most.
+        if (distance - (long)(len - j - 1) > max) return max + 1;
+        hp = (hp << 1) | 1;
+        hn <<= 1;
+        vp = hn | ~(d0 | hp);
+        vn = hp & d0;
+        pm_prev = pm;
+    }
+    return distance <= max ? distance : max + 1;
+}
+
+
+// myers_distance without a bound for count texts. Texts are taken
+// MYERS_LANES at a time and stepped together a character per round, so
+// the lanes' independent dependency chains overlap in the pipeline. (Lanes
+// in GCC vector registers measured slower: the per-character table lookups
+// have to be gathered lane by lane.)
+void myers_distances(const MyersPattern *p, const char *const *texts, const size_t *lens,
+                     int count, int *distances) {
+    for (int first = 0; first < count; first += MYERS_LANES) {
+        int lanes = count - first < MYERS_LANES ? count - first : MYERS_LANES;
+        if (p->len == 0) {
+            for (int l = 0; l < lanes; l++) distances[first + l] = lens[first + l];
+            continue;
+        }
+        uint64_t vp[MYERS_LANES], vn[MYERS_LANES], d0[MYERS_LANES], pm_prev[MYERS_LANES];
+        long distance[MYERS_LANES];
+        size_t longest = 0;
+        for (int l = 0; l < lanes; l++) {
+            vp[l] = ~(uint64_t)0;
+            vn[l] = d0[l] = pm_prev[l] = 0;
+            distance[l] = p->len;
+            if (lens[first + l] > longest) longest = lens[first + l];
+        }
+
+        uint64_t high = (uint64_t)1 << (p->len - 1);
+        for (size_t j = 0; j < longest; j++) {
+            for (int l = 0; l < lanes; l++) {
+                if (j >= lens[first + l]) continue;
+                uint64_t pm = p->peq[(unsigned char)texts[first + l][j]];
+                uint64_t tr = ((~d0[l] & pm) << 1) & pm_prev[l];
+                uint64_t d = (((pm & vp[l]) + vp[l]) ^ vp[l]) | pm | vn[l] | tr;
+                uint64_t hp = vn[l] | ~(d | vp[l]);
+                uint64_t hn = d & vp[l];
+                distance[l] += (hp & high) != 0;
+                distance[l] -= (hn & high) != 0;
+                hp = (hp << 1) | 1;
+                hn <<= 1;
+                vp[l] = hn | ~(d | hp);
+                vn[l] = hp & d;
+                d0[l] = d;
+                pm_prev[l] = pm;
+            }
+        }
+        for (int l = 0; l < lanes; l++) distances[first + l] = distance[l];
+    }
+}
+
+
+// State of one suggest_corrections call: the folded word and the best
+// candidates so far, ordered by distance and then by key. dict is the layer
+// being searched, layer its index among base's overlays or -1 for base
+// itself. The delete index collects candidates in pending and ranks them a
+// batch at a time.
+typedef struct {
+    const Dictionary *base;
+    int layer;
+    const Dictionary *dict;
+    const char *word;
+    size_t len;
+    Suggestion *best;
+    int count;
+    int limit;
+    Stats *stats;
+    const MyersPattern *pattern;
+    int pending[SUGGEST_BATCH];
+    int pending_count;
+} SuggestSearch;
+
+
+// The largest distance a key at entry first may have to still make the
+// list: once it is full, only closer keys, or equally close ones earlier in
+// the dictionary, can get in. Negative when none can. Layers are searched
+// one after the other, and keys of earlier layers win ties.
+int suggestion_bound(const SuggestSearch *s, int first) {
+    if (s->count < s->limit) return SUGGEST_MAX_DISTANCE;
+    const Suggestion *worst = &s->best[s->limit - 1];
+    return worst->dict == s->dict && first < worst->first ? worst->distance
+                                                          : worst->distance - 1;
+}
+
+
+void add_suggestion(SuggestSearch *s, int first, int distance) {
+    // A key of an earlier layer was offered there, whether or not it made
+    // the list, and is not offered again.
+    if (s->layer >= 0) {
+        const DictEntry *e = &s->dict->entries[first];
+        const char *key = s->dict->keys + e->offset;
+        uint32_t hash = hash_key(key, e->len);
+        int found;
+        for (int i = -1; i < s->layer; i++)
+            if (find_run(i < 0 ? s->base : s->base->overlays[i], key, e->len, hash, &found))
+                return;
+    }
+    int k = s->count < s->limit ? s->count++ : s->limit;
+    while (k > 0 && (s->best[k - 1].distance > distance ||
+                     (s->best[k - 1].distance == distance && s->best[k - 1].dict == s->dict &&
+                      s->best[k - 1].first > first))) {
+        if (k < s->limit) s->best[k] = s->best[k - 1];
+        k--;
+    }
+    if (k < s->limit) {
+        s->best[k].distance = distance;
+        s->best[k].first = first;
+        s->best[k].dict = s->dict;
+    }
+}
+
+
+// Ranks the pending candidates with one batched distance computation.
+void rank_pending(SuggestSearch *s) {
+    const char *texts[SUGGEST_BATCH] = { NULL };
+    size_t lens[SUGGEST_BATCH] = { 0 };
+    int distances[SUGGEST_BATCH];
+    for (int k = 0; k < s->pending_count; k++) {
+        const DictEntry *e = &s->dict->entries[s->pending[k]];
+        texts[k] = s->dict->keys + e->offset;
+        lens[k] = e->len;
+    }
+    myers_distances(s->pattern, texts, lens, s->pending_count, distances);
+    if (s->stats) s->stats->counters[STAT_EDIT_DISTANCES] += s->pending_count;
+    for (int k = 0; k < s->pending_count; k++)
+        if (distances[k] <= suggestion_bound(s, s->pending[k]))
+            add_suggestion(s, s->pending[k], distances[k]);
+    s->pending_count = 0;
+}
+
+
+// Checks every key filed under one delete hash of the word. Words too long
+// for the bit-parallel distance are compared one key at a time. The keys
+// of a hash come in entry order, so their bound only falls as they go on;
+// the word itself was offered already, so once no other key can get in,
+// neither can the rest. A key within one edit shares a hash with one
+// character or none deleted from each side, so the hashes with two deleted
+// are passed over once the list is full of such keys.
+void consider_delete(void *ctx, uint32_t hash, int deleted) {
+    SuggestSearch *s = ctx;
+    if (deleted == 2) {
+        if (s->pending_count) rank_pending(s);
+        if (suggestion_bound(s, 0) < 2) return;
+    }
+    const uint64_t *deletes = s->dict->deletes;
+    size_t bucket = ((uint64_t)hash << 32) >> s->dict->delete_shift;
+    // Bounded, as a compiled index is not checked in full when it is loaded.
+    uint64_t end = s->dict->delete_buckets[bucket + 1];
+    if (end > s->dict->delete_count) end = s->dict->delete_count;
+    for (uint64_t i = s->dict->delete_buckets[bucket]; i < end; i++) {
+        if (deletes[i] >> 32 != hash) {
+            if (deletes[i] >> 32 > hash) break;
+            continue;
+        }
+        if ((uint32_t)deletes[i] >= (uint32_t)s->dict->count) continue;
+        int first = (uint32_t)deletes[i];
+        int max = suggestion_bound(s, first);
+        if (max < 1) break;
+        int seen = 0;
+        for (int k = 0; k < s->count && !seen; k++)
+            seen = s->best[k].dict == s->dict && s->best[k].first == first;
+        for (int k = 0; k < s->pending_count && !seen; k++) seen = s->pending[k] == first;
+        if (seen) continue;
+
+        const DictEntry *e = &s->dict->entries[first];
+        if ((e->len > s->len ? e->len - s->len : s->len - e->len) > (size_t)max)
+            continue;
+        if (s->pattern) {
+            s->pending[s->pending_count++] = first;
+            if (s->pending_count == SUGGEST_BATCH) rank_pending(s);
+            continue;
+        }
+        if (s->stats) s->stats->counters[STAT_EDIT_DISTANCES]++;
+        int distance = edit_distance(s->word, s->len, s->dict->keys + e->offset, e->len, max);
+        if (distance <= max) add_suggestion(s, first, distance);
+    }
+}
+
+
+// A row of the Levenshtein automaton: the distances between a key prefix
+// of length d and the prefixes of the word of lengths d - MAX to d + MAX,
+// capped at MAX + 1. These are the only cells of the edit distance table
+// that can stay within MAX.
+typedef unsigned char AutomatonRow[2 * SUGGEST_MAX_DISTANCE + 1];
+
+
+// Fills rows[d] from the rows above it, as key[d - 1] is read. Returns the
+// smallest distance in the row: when it exceeds the bound, no key with this
+// prefix can be close enough.
+int automaton_step(const SuggestSearch *s, const char *key, size_t d, AutomatonRow *rows) {
+    const int max = SUGGEST_MAX_DISTANCE;
+    unsigned char *row = rows[d];
+    const unsigned char *up = rows[d - 1];
+    unsigned char c = key[d - 1];
+    int row_min = max + 1;
+    for (int t = 0; t <= 2 * max; t++) {
+        long j = (long)d + t - max;
+        int v = max + 1;
+        if (j == 0) {
+            v = d;
+        } else if (j > 0 && j <= (long)s->len) {
+            v = up[t] + (c != (unsigned char)s->word[j - 1]);
+            if (t < 2 * max && up[t + 1] + 1 < v) v = up[t + 1] + 1;
+            if (t > 0 && row[t - 1] + 1 < v) v = row[t - 1] + 1;
+            if (d > 1 && j > 1 && c == (unsigned char)s->word[j - 2] &&
+                key[d - 2] == s->word[j - 1] && rows[d - 2][t] + 1 < v)
+                v = rows[d - 2][t] + 1;
+        }
+        row[t] = v < max + 1 ? v : max + 1;
+        if (row[t] < row_min) row_min = row[t];
+    }
+    return row_min;
+}
+
+
+// The first entry in lo to hi whose key has a character of at least c at
+// depth d. All keys in the range share their first d characters and are
+// longer than d, so they are sorted by that character.
+int first_with_char(const Dictionary *dict, int lo, int hi, size_t d, unsigned c) {
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const DictEntry *e = &dict->entries[mid];
+        if ((unsigned char)dict->keys[e->offset + d] < c) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+// Visits the keys of entries lo to hi, which share the prefix whose row is
+// rows[d], walking the trie the sorted keys imply: each child is the range
+// of entries with the same next character, found by binary search. When
+// the row has no distance to spare, only characters of the word near depth
+// d can keep a key within the bound, so the walk jumps straight to those.
+void automaton_descend(SuggestSearch *s, AutomatonRow *rows, int lo, int hi, size_t d) {
+    const Dictionary *dict = s->dict;
+    const int max = SUGGEST_MAX_DISTANCE;
+    if (lo < hi && dict->entries[lo].len == d) {
+        long t = (long)s->len - (long)d + max;
+        if (s->stats) s->stats->counters[STAT_EDIT_DISTANCES]++;
+        if (t >= 0 && t <= 2 * max && rows[d][t] <= suggestion_bound(s, lo))
+            add_suggestion(s, lo, rows[d][t]);
+        while (lo < hi && dict->entries[lo].len == d) lo++;
+    }
+
+    int row_min = max + 1;
+    for (int t = 0; t <= 2 * max; t++)
+        if (rows[d][t] < row_min) row_min = rows[d][t];
+    // The characters that can match or transpose at depth d, sorted.
+    unsigned char near[2 * SUGGEST_MAX_DISTANCE + 2];
+    int near_count = 0;
+    for (long j = (long)d - max - 1; j <= (long)d + max; j++) {
+        if (j < 0 || j >= (long)s->len) continue;
+        unsigned char c = s->word[j];
+        int k = near_count++;
+        while (k > 0 && near[k - 1] > c) {
+            near[k] = near[k - 1];
+            k--;
+        }
+        near[k] = c;
+    }
+
+    while (lo < hi) {
+        int bound = suggestion_bound(s, lo);
+        if (bound < 0) return;
+        const char *key = dict->keys + dict->entries[lo].offset;
+        unsigned char c = key[d];
+        int tight = row_min >= bound;
+        int k = 0;
+        if (tight) {
+            while (k < near_count && near[k] < c) k++;
+            if (k == near_count) return;
+            if (near[k] != c) {
+                lo = first_with_char(dict, lo, hi, d, near[k]);
+                continue;
+            }
+        }
+        if (automaton_step(s, key, d + 1, rows) <= bound) {
+            int end = first_with_char(dict, lo, hi, d, c + 1u);
+            automaton_descend(s, rows, lo, end, d + 1);
+            lo = end;
+        } else if (tight) {
+            // Skip straight to the next character that could still match.
+            while (k < near_count && near[k] <= c) k++;
+            if (k == near_count) return;
+            lo = first_with_char(dict, lo, hi, d, near[k]);
+        } else {
+            lo = first_with_char(dict, lo, hi, d, c + 1u);
+        }
+    }
+}
+
+
+// Runs a Levenshtein automaton for the word over the sorted keys, which
+// needs no index of its own. Keys come in entry order, so the bound only
+// tightens once the list is full.
+void suggest_by_automaton(SuggestSearch *s) {
+    const int max = SUGGEST_MAX_DISTANCE;
+    AutomatonRow rows[MAX_WORD_LEN + SUGGEST_MAX_DISTANCE + 2];
+    for (int t = 0; t <= 2 * max; t++) rows[0][t] = t >= max ? t - max : max + 1;
+    automaton_descend(s, rows, 0, s->dict->count, 0);
+}
+
+
+// Finds up to limit keys within SUGGEST_MAX_DISTANCE edits of word, closest
+// first, with the delete index when one was built and the automaton
+// otherwise. Keys at equal distance come in dictionary order, layer by
+// layer as for lookups, as the dictionary has no word frequencies to rank
+// them by.
+int suggest_corrections(const Dictionary *dict, const char *word, size_t len,
+                        Suggestion *best, int limit, Stats *stats) {
+    char folded[MAX_WORD_LEN];
+    if (len > MAX_WORD_LEN) return 0;
+    for (size_t i = 0; i < len; i++) folded[i] = fold_case(word[i]);
+    SuggestSearch s = { dict, -1, dict, folded, len, best, 0, limit, stats, NULL, { 0 }, 0 };
+    MyersPattern pattern;
+    if (dict->deletes && len <= 64) {
+        myers_pattern(&pattern, folded, len);
+        s.pattern = &pattern;
+    }
+    for (int i = -1; i < dict->overlay_count; i++) {
+        s.layer = i;
+        s.dict = i < 0 ? dict : dict->overlays[i];
+        if (s.dict->deletes) {
+            // A key that differs from the word only in case.
+            int first;
+            if (find_run(s.dict, folded, len, hash_key(folded, len), &first) &&
+                suggestion_bound(&s, first) >= 0)
+                add_suggestion(&s, first, 0);
+            for_each_delete(folded, len < SUGGEST_PREFIX_LEN ? len : SUGGEST_PREFIX_LEN,
+                            consider_delete, &s);
+            if (s.pending_count) rank_pending(&s);
+        } else {
+            suggest_by_automaton(&s);
+        }
+    }
+    return s.count;
+}
+
+
+int is_all_digits_or_symbols(const char *word, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (isalpha((unsigned char)word[i])) return 0;
+    }
+    return 1;
+}
+
+
+const char *strip_leading_punctuation(const char *word, const char *end) {
+    while (word < end && *word && strchr("([{\'\"", *word)) word++;
+    return word;
+}
+
+
+const char *strip_trailing_punctuation(const char *word, const char *end) {
+    while (end > word && !isalnum((unsigned char)end[-1])) end--;
+    return end;
+}
+
+
+void out_reserve(OutBuf *out, size_t extra) {
+    if (out->len + extra <= out->capacity) return;
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity < out->len + extra) capacity *= 2;
+    out->data = realloc(out->data, capacity);
+    out->capacity = capacity;
+}
+
+
+void out_append(OutBuf *out, const char *s, size_t n) {
+    if (n == 0) return;
+    out_reserve(out, n);
+    memcpy(out->data + out->len, s, n);
+    out->len += n;
+}
+
+
+void out_append_int(OutBuf *out, int value) {
+    char digits[12];
+    int n = 0;
+    unsigned int v = value;
+    do {
+        digits[sizeof(digits) - ++n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    out_append(out, digits + sizeof(digits) - n, n);
+}
+
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+// Writes out a buffer that has an fd. Returns -1, having said so, when the
+// write fails, and again without a word for every flush after that.
+int out_flush(OutBuf *out) {
+    if (out->fd < 0) return 0;
+    if (out->len > 0 && !out->failed && write_all(out->fd, out->data, out->len) < 0) {
+        fprintf(stderr, "Error: Cannot write the report\n");
+        out->failed = 1;
+    }
+    out->len = 0;
+    return out->failed ? -1 : 0;
+}
+
+
+void out_free(OutBuf *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->capacity = 0;
+}
+
+
+// Formats "file:line:col word" (or "line:col word" without a file name),
+// followed by " -> a, b" when there are suggestions. Suggestions take the
+// capitalization of the word where the dictionary allows it.
+void report_misspelling(OutBuf *out, const char *filename, int line, int col,
+                        const char *word, size_t len, const Suggestion *suggestions,
+                        int suggestion_count) {
+    if (filename) {
+        out_append(out, filename, strlen(filename));
+        out_append(out, ":", 1);
+    }
+    out_append_int(out, line);
+    out_append(out, ":", 1);
+    out_append_int(out, col);
+    out_append(out, " ", 1);
+    out_append(out, word, len);
+    int word_all_upper = len > 1;
+    for (size_t i = 0; i < len; i++) word_all_upper &= !(word[i] >= 'a' && word[i] <= 'z');
+    for (int i = 0; i < suggestion_count; i++) {
+        const Dictionary *dict = suggestions[i].dict;
+        const DictEntry *e = &dict->entries[suggestions[i].first];
+        char fixed[MAX_WORD_LEN];
+        memcpy(fixed, dict->words + e->offset, e->len);
+        // Words that mix cases may not be written in all capitals.
+        int all_upper = word_all_upper && e->cap_class != CAP_INITIAL && e->cap_class != CAP_MIXED;
+        for (size_t j = 0; j < e->len; j++)
+            if ((all_upper || (j == 0 && isupper((unsigned char)word[0]))) &&
+                fixed[j] >= 'a' && fixed[j] <= 'z')
+                fixed[j] -= 'a' - 'A';
+        out_append(out, i ? ", " : " -> ", i ? 2 : 4);
+        out_append(out, fixed, e->len);
+    }
+    out_append(out, "\n", 1);
+    if (out->fd >= 0 && out->len >= OUTPUT_FLUSH_SIZE) out_flush(out);
+}
+
+
+// The suggestions kept with a verdict cache slot, or NULL when there is
+// no memory for them.
+Suggestion *slot_suggestions(Checker *ck, const VerdictEntry *slot) {
+    if (!ck->suggestions)
+        ck->suggestions = malloc(((size_t)suggestion_limit << VERDICT_CACHE_BITS) *
+                                 sizeof(Suggestion));
+    if (!ck->suggestions) return NULL;
+    return ck->suggestions + (slot - ck->verdicts) * suggestion_limit;
+}
+
+
+// Reports a misspelled word, reusing the suggestions of its verdict cache
+// slot when cached is set and finding them, and keeping them in the slot,
+// otherwise.
+void report_word(Checker *ck, VerdictEntry *slot, int cached, const char *start, size_t len,
+                 const char *filename, int line, int col, int *error_found) {
+    ck->stats->counters[STAT_MISSES]++;
+    Suggestion found[SUGGEST_MAX];
+    Suggestion *suggestions = found;
+    int suggestion_count = 0;
+    if (suggestion_limit && !ck->dict->trie) {
+        Suggestion *kept = slot ? slot_suggestions(ck, slot) : NULL;
+        if (kept) suggestions = kept;
+        if (cached && kept) {
+            suggestion_count = slot->suggestion_count;
+        } else {
+            suggestion_count = suggest_corrections(ck->dict, start, len, suggestions,
+                                                   suggestion_limit, ck->stats);
+            if (kept) slot->suggestion_count = suggestion_count;
+        }
+    }
+    report_misspelling(ck->out, filename, line, col, start, len, suggestions,
+                       suggestion_count);
+    *error_found = 1;
+}
+
+
+// The verdict cache slot for a token of at most VERDICT_KEY_MAX bytes,
+// whose bytes are copied into key, zero padded, to compare with the slot's.
+VerdictEntry *verdict_slot(Checker *ck, const char *word, size_t len,
+                           uint64_t key[VERDICT_KEY_MAX / 8]) {
+    if (!ck->verdicts)
+        ck->verdicts = calloc((size_t)1 << VERDICT_CACHE_BITS, sizeof(VerdictEntry));
+    memset(key, 0, VERDICT_KEY_MAX);
+    memcpy(key, word, len);
+    uint64_t hash = len;
+    for (int i = 0; i < VERDICT_KEY_MAX / 8; i++) hash = (hash ^ key[i]) * 0x9e3779b97f4a7c15ull;
+    return &ck->verdicts[hash >> (64 - VERDICT_CACHE_BITS)];
+}
+
+
+// Checks one token given as a span of the input. Punctuation is stripped
+// by narrowing the span; nothing is copied unless the word is reported.
+// Tokens recur a great deal in real text, so each thread remembers the
+// verdicts of recent ones by their raw bytes, with the suggestions for
+// misspelled ones, and skips stripping, the dictionary lookup and the
+// suggestion search when a token comes again.
+void check_word(Checker *ck, const char *word, size_t len, const char *filename,
+                int line, int col, int *error_found) {
+    // A NUL byte ends the token, as it always has for C-string tokens.
+    ck->stats->counters[STAT_TOKENS]++;
+    const char *nul = memchr(word, '\0', len);
+    if (nul) len = nul - word;
+    if (len == 0) return;
+
+
+    uint64_t key[VERDICT_KEY_MAX / 8];
+    VerdictEntry *slot = NULL;
+    if (len <= VERDICT_KEY_MAX) {
+        slot = verdict_slot(ck, word, len, key);
+        if (slot->len == len && memcmp(slot->key, key, VERDICT_KEY_MAX) == 0) {
+            ck->stats->counters[STAT_VERDICT_HITS]++;
+            if (slot->verdict == VERDICT_CORRECT)
+                ck->stats->counters[STAT_HITS]++;
+            else if (slot->verdict == VERDICT_MISSPELLED)
+                report_word(ck, slot, 1, word + slot->lead, slot->stripped_len, filename, line,
+                            col, error_found);
+            return;
+        }
+    }
+
+
+    int verdict = VERDICT_SKIP;
+    const char *start = word;
+    const char *end = word + len;
+    if (!is_all_digits_or_symbols(word, len)) {
+        start = strip_leading_punctuation(word, end);
+        end = strip_trailing_punctuation(start, end);
+        if (end > start && !is_all_digits_or_symbols(start, end - start)) {
+            ck->stats->counters[STAT_LOOKUPS]++;
+            verdict = word_in_dictionary(ck->dict, start, end - start, ck->stats)
+                ? VERDICT_CORRECT : VERDICT_MISSPELLED;
+        }
+    }
+    if (slot) {
+        memcpy(slot->key, key, VERDICT_KEY_MAX);
+        slot->len = len;
+        slot->verdict = verdict;
+        slot->lead = start - word;
+        slot->stripped_len = end - start;
+    }
+    if (verdict == VERDICT_CORRECT)
+        ck->stats->counters[STAT_HITS]++;
+    else if (verdict == VERDICT_MISSPELLED)
+        report_word(ck, slot, 0, start, end - start, filename, line, col, error_found);
+}
+
+
+// Whitespace as isspace() sees it in the C locale: ' ' and '\t'..'\r'.
+uint32_t classify_scalar(const unsigned char *p, uint32_t *newlines) {
+    uint32_t spaces = 0, lines = 0;
+    for (int i = 0; i < 32; i++) {
+        spaces |= (uint32_t)(p[i] == ' ' || (unsigned char)(p[i] - '\t') <= '\r' - '\t') << i;
+        lines |= (uint32_t)(p[i] == '\n') << i;
+    }
+    *newlines = lines;
+    return spaces;
+}
+
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+uint32_t classify_sse2(const unsigned char *p, uint32_t *newlines) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i range = _mm_set1_epi8('\r' - '\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint32_t spaces = 0, lines = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * half));
+        __m128i t = _mm_sub_epi8(v, tab);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                  _mm_cmpeq_epi8(_mm_min_epu8(t, range), t));
+        spaces |= (uint32_t)_mm_movemask_epi8(ws) << (16 * half);
+        lines |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << (16 * half);
+    }
+    *newlines = lines;
+    return spaces;
+}
+
+
+__attribute__((target("avx2")))
+uint32_t classify_avx2(const unsigned char *p, uint32_t *newlines) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i ws = _mm256_or_si256(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t));
+    *newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return _mm256_movemask_epi8(ws);
+}
+#endif
+
+
+ClassifyFn classify_block = classify_scalar;
+
+
+// Picks the widest classifier the CPU supports. Called once from main
+// before any worker thread starts.
+void select_tokenizer() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        classify_block = classify_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        classify_block = classify_sse2;
+#endif
+}
+
+
+void append_to_word(Tokenizer *tok, const char *s, size_t len) {
+    size_t room = MAX_WORD_LEN - 1 - tok->word_len;
+    if (len > room) len = room;
+    if (len == 0) return;
+    memcpy(tok->word + tok->word_len, s, len);
+    tok->word_len += len;
+}
+
+
+// Checks the word ending with tail. Only words that straddle two reads
+// were collected in tok->word; all others are checked in place.
+void finish_word(Checker *ck, Tokenizer *tok, const char *tail, size_t tail_len) {
+    if (tok->word_len == 0) {
+        if (tail_len > MAX_WORD_LEN - 1) tail_len = MAX_WORD_LEN - 1;
+        check_word(ck, tail, tail_len, tok->filename, tok->word_line, tok->word_col,
+                   &tok->error_found);
+    } else {
+        append_to_word(tok, tail, tail_len);
+        check_word(ck, tok->word, tok->word_len, tok->filename, tok->word_line,
+                   tok->word_col, &tok->error_found);
+    }
+    tok->word_len = 0;
+    tok->in_word = 0;
+}
+
+
+// Splits a chunk of input into words 32 bytes at a time. Word boundaries
+// and newlines are found from the classifier's bitmasks, so the loop only
+// branches once per word or line rather than once per byte.
+void tokenize_chunk(Checker *ck, Tokenizer *tok, const char *buf, size_t n) {
+    size_t word_begin = 0;
+    for (size_t i = 0; i < n; i += 32) {
+        const unsigned char *p = (const unsigned char *)buf + i;
+        unsigned char block[32];
+        size_t avail = n - i < 32 ? n - i : 32;
+        uint32_t valid = avail < 32 ? (1u << avail) - 1 : ~0u;
+        if (avail < 32) {
+            memcpy(block, p, avail);
+            memset(block + avail, 0, 32 - avail);
+            p = block;
+        }
+
+        uint32_t newlines;
+        uint32_t spaces = classify_block(p, &newlines);
+        uint32_t after_space = (spaces << 1) | tok->prev_space;
+        uint32_t starts = ~spaces & after_space & valid;
+        uint32_t ends = spaces & ~after_space & valid;
+        newlines &= valid;
+        tok->prev_space = (spaces >> (avail - 1)) & 1;
+
+        uint32_t events = starts | ends | newlines;
+        while (events) {
+            int bit = __builtin_ctz(events);
+            uint32_t mask = 1u << bit;
+            size_t at = i + bit;
+            if (ends & mask)
+                finish_word(ck, tok, buf + word_begin, at - word_begin);
+            if (newlines & mask) {
+                tok->line++;
+                tok->line_start = tok->offset + at + 1;
+            }
+            if (starts & mask) {
+                tok->in_word = 1;
+                tok->word_line = tok->line;
+                tok->word_col = tok->offset + at - tok->line_start + 1;
+                word_begin = at;
+            }
+            events &= events - 1;
+        }
+    }
+    if (tok->in_word) append_to_word(tok, buf + word_begin, n - word_begin);
+    tok->offset += n;
+}
+
+
+// Returns the checker's buffer, grown to hold at least size bytes.
+char *checker_buffer(Checker *ck, size_t size) {
+    if (ck->buffer_size < size) {
+        free(ck->buffer);
+        ck->buffer_size = size > READ_BUFFER_SIZE ? size : READ_BUFFER_SIZE;
+        ck->buffer = malloc(ck->buffer_size);
+    }
+    return ck->buffer;
+}
+
+
+void release_checker(Checker *ck) {
+    free(ck->buffer);
+    free(ck->verdicts);
+    free(ck->suggestions);
+}
+
+
+ssize_t counted_read(Checker *ck, int fd, char *buffer, size_t len) {
+    ck->stats->counters[STAT_IO_SYSCALLS]++;
+    return read(fd, buffer, len);
+}
+
+
+int check_file(Checker *ck, const char *filename, int show_filename) {
+    int fd = (filename == NULL) ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        // Reports printed so far go out before the error, so the two read
+        // in order on a terminal.
+        out_flush(ck->out);
+        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        return 1;
+    }
+    PhaseTime phase = phase_start();
+    ck->stats->counters[STAT_FILES]++;
+
+
+    Tokenizer tok;
+    memset(&tok, 0, sizeof(tok));
+    tok.filename = show_filename ? filename : NULL;
+    tok.line = 1;
+    tok.prev_space = 1;
+
+
+    // Every word of a regular file is a span of one block: large files are
+    // mapped, and smaller ones are read whole into the checker's buffer,
+    // which takes one read instead of a map, an unmap and a page fault per
+    // page. Anything else is streamed through the buffer.
+    struct stat st;
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t size = regular ? (size_t)st.st_size : 0;
+    void *map = MAP_FAILED;
+    if (size >= MMAP_THRESHOLD && map_input_files) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ck->stats->counters[STAT_IO_SYSCALLS]++;
+    }
+    if (map != MAP_FAILED) {
+        posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+        tokenize_chunk(ck, &tok, map, size);
+        ck->stats->counters[STAT_BYTES_READ] += size;
+        munmap(map, size);
+        ck->stats->counters[STAT_IO_SYSCALLS] += 2;
+    } else if (size > 0 && size < MMAP_THRESHOLD) {
+        char *buffer = checker_buffer(ck, size);
+        size_t got = 0;
+        ssize_t bytes_read;
+        while (got < size && (bytes_read = counted_read(ck, fd, buffer + got, size - got)) > 0)
+            got += bytes_read;
+        tokenize_chunk(ck, &tok, buffer, got);
+        ck->stats->counters[STAT_BYTES_READ] += got;
+    } else {
+        char *buffer = checker_buffer(ck, READ_BUFFER_SIZE);
+        if (size > 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            ck->stats->counters[STAT_IO_SYSCALLS]++;
+        }
+        ssize_t bytes_read;
+        while ((bytes_read = counted_read(ck, fd, buffer, ck->buffer_size)) > 0) {
+            tokenize_chunk(ck, &tok, buffer, bytes_read);
+            ck->stats->counters[STAT_BYTES_READ] += bytes_read;
+            // Keep interactive input responsive.
+            if (filename == NULL) out_flush(ck->out);
+        }
+    }
+
+
+    if (tok.in_word) finish_word(ck, &tok, NULL, 0);
+
+
+    if (filename != NULL) close(fd);
+    phase_end(&ck->stats->phases[PHASE_CHECK_FILE], phase);
+    return tok.error_found;
+}
+
+
+// Steps of hash_bytes, for data that comes in blocks: hash_words folds in
+// the whole 8-byte words of a block, and hash_tail the last len % 8 bytes.
+uint64_t hash_words(uint64_t hash, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+        p += 8;
+        len -= 8;
+    }
+    return hash;
+}
+
+
+uint64_t hash_tail(uint64_t hash, const unsigned char *p, size_t len) {
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+
+// 64-bit hash for telling file contents apart; not meant to resist
+// deliberate collisions.
+uint64_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = hash_words(0x9e3779b97f4a7c15ull ^ len, p, len);
+    return hash_tail(hash, p + (len & ~(size_t)7), len & 7);
+}
+
+
+// Hash of the text of a dictionary and its overlays, in lookup order.
+// base_hash is that of the dictionary's own text, taken when it was loaded,
+// as a trie built from it keeps none.
+uint64_t dictionary_fingerprint(const Dictionary *dict, uint64_t base_hash) {
+    uint64_t hash = base_hash;
+    for (int i = 0; i < dict->overlay_count; i++)
+        hash = (hash ^ hash_bytes(dict->overlays[i]->data, dict->overlays[i]->size)) *
+               0x9e3779b97f4a7c15ull;
+    return hash;
+}
+
+
+// Identifies the version of a file a cached report belongs to.
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+} FileStamp;
+
+
+int stamp_file(const char *path, FileStamp *stamp, int with_hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    stamp->size = st.st_size;
+    stamp->mtime_sec = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    stamp->content_hash = 0;
+    // The file is read in blocks rather than mapped, so that one cut short
+    // meanwhile gives a stale hash rather than SIGBUS. Blocks are whole
+    // words, and the hash is that of hash_bytes over the whole file.
+    ssize_t bytes_read = 0;
+    if (with_hash) {
+        unsigned char *buffer = malloc(READ_BUFFER_SIZE);
+        uint64_t hash = 0x9e3779b97f4a7c15ull ^ stamp->size;
+        size_t got;
+        do {
+            got = 0;
+            while (got < READ_BUFFER_SIZE &&
+                   (bytes_read = read(fd, buffer + got, READ_BUFFER_SIZE - got)) > 0)
+                got += bytes_read;
+            hash = hash_words(hash, buffer, got);
+        } while (got == READ_BUFFER_SIZE);
+        stamp->content_hash = hash_tail(hash, buffer + (got & ~(size_t)7), got & 7);
+        free(buffer);
+    }
+    close(fd);
+    return bytes_read < 0 ? -1 : 0;
+}
+
+
+// A saved report, keyed by the real path of the file. name is the path as
+// it was given, which the report quotes when show_filename is set.
+typedef struct {
+    char *path;
+    char *name;
+    FileStamp stamp;
+    int show_filename;
+    int error_found;
+    int used;
+    char *output;
+    size_t output_len;
+} CacheEntry;
+
+
+// On-disk layout of a cache file: a CacheHeader, then per entry a
+// CacheRecord followed by the real path, the name and the report text.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t fingerprint;
+    uint64_t count;
+} CacheHeader;
+
+
+typedef struct {
+    uint32_t path_len;
+    uint32_t show_filename;
+    uint64_t output_len;
+    FileStamp stamp;
+    uint32_t error_found;
+    uint32_t name_len;
+} CacheRecord;
+
+
+// Reports of earlier runs by path (--cache). Entries are only valid for
+// the dictionary and options whose fingerprint they were saved with.
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t fingerprint;
+    CacheEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t *slots;
+    size_t slot_mask;
+} CheckCache;
+
+
+CheckCache *check_cache = NULL;
+
+
+size_t *cache_slot(CheckCache *cache, const char *path) {
+    uint32_t hash = hash_key(path, strlen(path));
+    size_t i = hash & cache->slot_mask;
+    while (cache->slots[i] != SIZE_MAX && strcmp(cache->entries[cache->slots[i]].path, path) != 0)
+        i = (i + 1) & cache->slot_mask;
+    return &cache->slots[i];
+}
+
+
+// Adds or replaces the entry for entry->path, taking over its strings.
+void cache_put(CheckCache *cache, CacheEntry *entry) {
+    if ((cache->count + 1) * 2 > cache->slot_mask) {
+        free(cache->slots);
+        cache->slot_mask = cache->slot_mask ? cache->slot_mask * 2 + 1 : 255;
+        cache->slots = malloc((cache->slot_mask + 1) * sizeof(size_t));
+        memset(cache->slots, 0xff, (cache->slot_mask + 1) * sizeof(size_t));
+        for (size_t i = 0; i < cache->count; i++)
+            *cache_slot(cache, cache->entries[i].path) = i;
+    }
+    size_t *slot = cache_slot(cache, entry->path);
+    if (*slot != SIZE_MAX) {
+        CacheEntry *old = &cache->entries[*slot];
+        free(old->path);
+        free(old->name);
+        free(old->output);
+        *old = *entry;
+        return;
+    }
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 256;
+        cache->entries = realloc(cache->entries, cache->capacity * sizeof(CacheEntry));
+    }
+    cache->entries[cache->count] = *entry;
+    *slot = cache->count++;
+}
+
+
+void free_cache_entry(CacheEntry *entry) {
+    free(entry->path);
+    free(entry->name);
+    free(entry->output);
+}
+
+
+// Reads the cache file at path. A missing or unreadable file, or one saved
+// for another fingerprint, gives an empty cache. Loading stops at the first
+// record that does not fit in what is left of the file, so a damaged cache
+// only loses the entries from there on.
+CheckCache *load_cache(const char *path, uint64_t fingerprint) {
+    CheckCache *cache = calloc(1, sizeof(CheckCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fingerprint = fingerprint;
+
+    FILE *in = fopen(path, "rb");
+    if (!in) return cache;
+    struct stat st;
+    CacheHeader header;
+    if (fstat(fileno(in), &st) != 0 || fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != CACHE_VERSION ||
+        header.fingerprint != fingerprint) {
+        fclose(in);
+        return cache;
+    }
+    uint64_t left = st.st_size > (off_t)sizeof(header) ? st.st_size - sizeof(header) : 0;
+    for (uint64_t i = 0; i < header.count; i++) {
+        CacheRecord record;
+        if (left < sizeof(record) || fread(&record, sizeof(record), 1, in) != 1) break;
+        left -= sizeof(record);
+        if (record.path_len > PATH_BUFFER_SIZE || record.name_len > PATH_BUFFER_SIZE ||
+            record.path_len + record.name_len > left ||
+            record.output_len > left - record.path_len - record.name_len)
+            break;
+        left -= record.path_len + record.name_len + record.output_len;
+        CacheEntry entry = { malloc(record.path_len + 1), malloc(record.name_len + 1),
+                             record.stamp, record.show_filename, record.error_found, 0,
+                             malloc(record.output_len + 1), record.output_len };
+        if (!entry.path || !entry.name || !entry.output ||
+            fread(entry.path, 1, record.path_len, in) != record.path_len ||
+            fread(entry.name, 1, record.name_len, in) != record.name_len ||
+            fread(entry.output, 1, record.output_len, in) != record.output_len) {
+            free_cache_entry(&entry);
+            break;
+        }
+        entry.path[record.path_len] = '\0';
+        entry.name[record.name_len] = '\0';
+        cache_put(cache, &entry);
+    }
+    fclose(in);
+    return cache;
+}
+
+
+// Writes the entries used in this run, so files that are gone drop out.
+// The new file replaces the old one only once it is complete.
+int save_cache(CheckCache *cache, const char *path) {
+    char tmp_path[PATH_BUFFER_SIZE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create cache file '%s'\n", tmp_path);
+        return 1;
+    }
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.fingerprint = cache->fingerprint;
+    for (size_t i = 0; i < cache->count; i++) header.count += cache->entries[i].used;
+    fwrite(&header, sizeof(header), 1, out);
+    for (size_t i = 0; i < cache->count; i++) {
+        const CacheEntry *e = &cache->entries[i];
+        if (!e->used) continue;
+        CacheRecord record;
+        memset(&record, 0, sizeof(record));
+        record.path_len = strlen(e->path);
+        record.name_len = strlen(e->name);
+        record.show_filename = e->show_filename;
+        record.output_len = e->output_len;
+        record.stamp = e->stamp;
+        record.error_found = e->error_found;
+        fwrite(&record, sizeof(record), 1, out);
+        fwrite(e->path, 1, record.path_len, out);
+        fwrite(e->name, 1, record.name_len, out);
+        fwrite(e->output, 1, e->output_len, out);
+    }
+    if (ferror(out) | fclose(out) || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error: Cannot write cache file '%s'\n", path);
+        unlink(tmp_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+void free_cache(CheckCache *cache) {
+    for (size_t i = 0; i < cache->count; i++) free_cache_entry(&cache->entries[i]);
+    free(cache->entries);
+    free(cache->slots);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+
+// Copies the cached report of the file at name into *output if the file
+// has not changed since it was saved, and the report would read the same.
+// The content is only hashed when the size matches but the modification
+// time does not.
+int cache_lookup(CheckCache *cache, const char *name, int show_filename, OutBuf *output,
+                 int *error_found) {
+    FileStamp now;
+    char *path = realpath(name, NULL);
+    if (!path || stamp_file(path, &now, 0) != 0) {
+        free(path);
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    size_t idx = cache->slot_mask ? *cache_slot(cache, path) : SIZE_MAX;
+    CacheEntry *e = idx != SIZE_MAX ? &cache->entries[idx] : NULL;
+    int hit = e && e->show_filename == show_filename &&
+              (!show_filename || strcmp(e->name, name) == 0) && e->stamp.size == now.size;
+    if (hit && (e->stamp.mtime_sec != now.mtime_sec || e->stamp.mtime_nsec != now.mtime_nsec)) {
+        uint64_t content_hash = e->stamp.content_hash;
+        pthread_mutex_unlock(&cache->lock);
+        hit = stamp_file(path, &now, 1) == 0 && now.content_hash == content_hash;
+        pthread_mutex_lock(&cache->lock);
+        e = &cache->entries[idx];
+        if (hit) e->stamp = now;
+    }
+    if (hit) {
+        out_append(output, e->output, e->output_len);
+        *error_found = e->error_found;
+        e->used = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(path);
+    return hit;
+}
+
+
+// Takes over path, the real path of the file at name.
+void cache_store(CheckCache *cache, char *path, const char *name, int show_filename,
+                 const FileStamp *stamp, const OutBuf *output, int error_found) {
+    CacheEntry entry = { path, strdup(name), *stamp, show_filename, error_found, 1,
+                         malloc(output->len + 1), output->len };
+    if (output->len) memcpy(entry.output, output->data, output->len);
+    pthread_mutex_lock(&cache->lock);
+    cache_put(cache, &entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+// check_file for a cached run: the file is stamped before it is read, so
+// a change made while checking it is noticed next time.
+int check_file_cached(Checker *ck, const char *path, int show_filename) {
+    FileStamp stamp;
+    char *real = realpath(path, NULL);
+    int stamped = real && stamp_file(real, &stamp, 1) == 0;
+    OutBuf *out = ck->out;
+    OutBuf output = { NULL, 0, 0, -1, 0 };
+    ck->out = &output;
+    int error_found = check_file(ck, path, show_filename);
+    ck->out = out;
+    if (stamped)
+        cache_store(check_cache, real, path, show_filename, &stamp, &output, error_found);
+    else
+        free(real);
+    out_append(out, output.data, output.len);
+    out_free(&output);
+    return error_found;
+}
+
+
+// Prints finished reports in submission order so the output matches a
+// serial run byte for byte. Only one thread prints at a time; it batches
+// the reports that are ready and writes them without holding the lock.
+// Called and returns with the pool locked.
+void print_finished_jobs(WorkPool *pool) {
+    if (pool->printing) return;
+    pool->printing = 1;
+    OutBuf batch = { NULL, 0, 0, STDOUT_FILENO, pool->output_failed };
+    while (pool->next_print < pool->job_count && pool->jobs[pool->next_print].done) {
+        while (pool->next_print < pool->job_count && pool->jobs[pool->next_print].done &&
+               batch.len < OUTPUT_FLUSH_SIZE) {
+            Job *job = &pool->jobs[pool->next_print++];
+            out_append(&batch, job->output.data, job->output.len);
+            if (job->error_found) pool->error_found = 1;
+            out_free(&job->output);
+            free(job->path);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        int failed = out_flush(&batch) < 0;
+        pthread_mutex_lock(&pool->lock);
+        if (failed) pool->output_failed = pool->error_found = 1;
+    }
+    out_free(&batch);
+    pool->printing = 0;
+}
+
+
+void *pool_worker(void *arg) {
+    WorkPool *pool = arg;
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    Checker ck = { pool->dict, NULL, NULL, &stats, NULL, 0, NULL, NULL };
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->next_job == pool->job_count && !pool->closed)
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        if (pool->next_job == pool->job_count) break;
+        size_t idx = pool->next_job++;
+        if (pool->jobs[idx].done) continue;
+        char *path = pool->jobs[idx].path;
+        int show_filename = pool->jobs[idx].show_filename;
+        pthread_mutex_unlock(&pool->lock);
+
+        OutBuf output = { NULL, 0, 0, -1, 0 };
+        ck.out = &output;
+        int error_found = check_cache ? check_file_cached(&ck, path, show_filename)
+                                      : check_file(&ck, path, show_filename);
+
+        pthread_mutex_lock(&pool->lock);
+        Job *job = &pool->jobs[idx];
+        job->output = output;
+        job->error_found = error_found;
+        job->done = 1;
+        print_finished_jobs(pool);
+    }
+    merge_stats(&pool->stats, &stats);
+    pthread_mutex_unlock(&pool->lock);
+    release_checker(&ck);
+    return NULL;
+}
+
+
+// Starts as many of thread_count workers as the system allows. Returns
+// NULL when none start, and the files are then checked serially.
+WorkPool *start_pool(Dictionary *dict, int thread_count) {
+    WorkPool *pool = calloc(1, sizeof(WorkPool));
+    pool->dict = dict;
+    pool->threads = malloc(thread_count * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    while (pool->threads && pool->thread_count < thread_count &&
+           pthread_create(&pool->threads[pool->thread_count], NULL, pool_worker, pool) == 0)
+        pool->thread_count++;
+    if (pool->thread_count == 0) {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->job_ready);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+
+// Appends an empty job. Called with the pool locked.
+Job *add_job(WorkPool *pool) {
+    if (pool->job_count == pool->job_capacity) {
+        pool->job_capacity = pool->job_capacity ? pool->job_capacity * 2 : 256;
+        pool->jobs = realloc(pool->jobs, pool->job_capacity * sizeof(Job));
+    }
+    Job *job = &pool->jobs[pool->job_count++];
+    memset(job, 0, sizeof(Job));
+    return job;
+}
+
+
+void submit_file(WorkPool *pool, const char *path, int show_filename) {
+    pthread_mutex_lock(&pool->lock);
+    Job *job = add_job(pool);
+    job->path = strdup(path);
+    job->show_filename = show_filename;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Queues a report that needs no checking, such as one from the cache.
+void submit_output(WorkPool *pool, OutBuf output, int error_found) {
+    pthread_mutex_lock(&pool->lock);
+    Job *job = add_job(pool);
+    job->output = output;
+    job->error_found = error_found;
+    job->done = 1;
+    print_finished_jobs(pool);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Waits for all queued files to be checked and printed, then releases the
+// pool. Returns whether any of them had errors and adds the workers'
+// counters to stats, with the wait as check_file wall time.
+int finish_pool(WorkPool *pool, Stats *stats) {
+    PhaseTime wait = phase_start();
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    phase_end(&stats->phases[PHASE_CHECK_FILE], wait);
+
+    int error_found = pool->error_found;
+    merge_stats(stats, &pool->stats);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+    return error_found;
+}
+
+
+// A directory watched by --watch, by watch descriptor. Every file with the
+// suffix in a recursive one is checked again when it changes, and its new
+// subdirectories are walked; otherwise only the files named on the command
+// line are.
+typedef struct {
+    char *path;
+    int recursive;
+    char **files;
+    int file_count;
+} WatchDir;
+
+
+// A file to check again once the events read so far are handled.
+typedef struct {
+    char *path;
+    int show_filename;
+} Change;
+
+
+// While a batch of events is handled, collecting is set and files to check
+// again gather in changes, including those found by walking new
+// directories. move_path is a directory moved away whose IN_MOVED_TO, with
+// the same cookie, may still come.
+typedef struct {
+    int fd;
+    WatchDir *dirs;
+    int dir_capacity;
+    const char *suffix;
+    int show_filename;
+    int collecting;
+    Change *changes;
+    int change_count;
+    uint32_t move_cookie;
+    char *move_path;
+} Watcher;
+
+
+// Set for --watch, so that walking a directory also watches it.
+Watcher *watcher = NULL;
+
+
+// Saves reach a file either by writing it in place or by renaming a new
+// copy over it, and a directory shows up by being made or moved in.
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE)
+
+
+WatchDir *watch_directory(Watcher *w, const char *path, int recursive) {
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Error: Cannot watch '%s'\n", path);
+        return NULL;
+    }
+    if (wd >= w->dir_capacity) {
+        int capacity = w->dir_capacity ? w->dir_capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        w->dirs = realloc(w->dirs, capacity * sizeof(WatchDir));
+        memset(w->dirs + w->dir_capacity, 0, (capacity - w->dir_capacity) * sizeof(WatchDir));
+        w->dir_capacity = capacity;
+    }
+    WatchDir *dir = &w->dirs[wd];
+    if (!dir->path) dir->path = strdup(path);
+    dir->recursive |= recursive;
+    return dir;
+}
+
+
+// Watches a file named on the command line through its directory, as a
+// save by rename replaces the file itself.
+void watch_file(Watcher *w, const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir_path[PATH_BUFFER_SIZE];
+    if (!slash) {
+        strcpy(dir_path, ".");
+    } else if ((size_t)(slash - path) < sizeof(dir_path)) {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        memcpy(dir_path, path, len);
+        dir_path[len] = '\0';
+    } else {
+        fprintf(stderr, "Error: Cannot watch '%s'\n", path);
+        return;
+    }
+    WatchDir *dir = watch_directory(w, dir_path, 0);
+    if (!dir) return;
+    dir->files = realloc(dir->files, (dir->file_count + 1) * sizeof(char *));
+    dir->files[dir->file_count++] = strdup(path);
+}
+
+
+void forget_watch(WatchDir *dir) {
+    free(dir->path);
+    for (int i = 0; i < dir->file_count; i++) free(dir->files[i]);
+    free(dir->files);
+    memset(dir, 0, sizeof(WatchDir));
+}
+
+
+void free_watcher(Watcher *w) {
+    for (int i = 0; i < w->dir_capacity; i++) forget_watch(&w->dirs[i]);
+    free(w->dirs);
+    free(w->move_path);
+    close(w->fd);
+    free(w);
+}
+
+
+void add_change(Watcher *w, const char *path, int show_filename) {
+    for (int i = 0; i < w->change_count; i++) {
+        if (strcmp(w->changes[i].path, path) == 0) {
+            w->changes[i].show_filename |= show_filename;
+            return;
+        }
+    }
+    w->changes = realloc(w->changes, (w->change_count + 1) * sizeof(Change));
+    w->changes[w->change_count].path = strdup(path);
+    w->changes[w->change_count++].show_filename = show_filename;
+}
+
+
+void visit_file(Checker *ck, const char *path, int show_filename, int *error_found) {
+    if (watcher && watcher->collecting) {
+        add_change(watcher, path, show_filename);
+        return;
+    }
+    if (check_cache) {
+        OutBuf output = { NULL, 0, 0, -1, 0 };
+        int cached_error = 0;
+        if (cache_lookup(check_cache, path, show_filename, &output, &cached_error)) {
+            ck->stats->counters[STAT_CACHE_HITS]++;
+            if (ck->pool) {
+                submit_output(ck->pool, output, cached_error);
+                return;
+            }
+            out_append(ck->out, output.data, output.len);
+            out_free(&output);
+            if (ck->out->fd >= 0 && ck->out->len >= OUTPUT_FLUSH_SIZE) out_flush(ck->out);
+            if (cached_error) *error_found = 1;
+            return;
+        }
+    }
+    if (ck->pool)
+        submit_file(ck->pool, path, show_filename);
+    else if (check_cache ? check_file_cached(ck, path, show_filename)
+                         : check_file(ck, path, show_filename))
+        *error_found = 1;
+}
+
+
+// Walks the directory open at fd, whose path is the first path_len bytes
+// of path. Entry types come from d_type where the file system gives them;
+// only symbolic links and DT_UNKNOWN entries need an fstatat, and
+// subdirectories are opened relative to their parent. path is extended in
+// place for each entry.
+int walk_directory(Checker *ck, int fd, char *path, size_t path_len, const char *suffix,
+                   int *error_found) {
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        out_flush(ck->out);
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", path);
+        return 1;
+    }
+    // Watched before it is read, so no file added meanwhile goes unseen.
+    if (watcher) watch_directory(watcher, path, 1);
+
+
+    size_t suffix_len = strlen(suffix);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.') continue;
+
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, 0) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        size_t name_len = strlen(name);
+        if (type == DT_REG &&
+            (name_len < suffix_len || strcmp(name + name_len - suffix_len, suffix) != 0))
+            continue;
+        if (type != DT_DIR && type != DT_REG) continue;
+        if (path_len + 1 + name_len >= PATH_BUFFER_SIZE) {
+            out_flush(ck->out);
+            fprintf(stderr, "Error: Path too long in '%s'\n", path);
+            *error_found = 1;
+            continue;
+        }
+
+
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, name, name_len + 1);
+        if (type == DT_DIR) {
+            int sub = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY);
+            walk_directory(ck, sub, path, path_len + 1 + name_len, suffix, error_found);
+        } else {
+            visit_file(ck, path, 1, error_found);
+        }
+        path[path_len] = '\0';
     }
 
 
@@ -338,24 +3156,719 @@ int check_directory(Dictionary *dict, const char *path, const char *suffix, int
 }
 
 
+int check_directory(Checker *ck, const char *path, const char *suffix, int *error_found) {
+    char fullpath[PATH_BUFFER_SIZE];
+    size_t len = strlen(path);
+    if (len >= sizeof(fullpath)) {
+        out_flush(ck->out);
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", path);
+        return 1;
+    }
+    memcpy(fullpath, path, len + 1);
+    return walk_directory(ck, open(path, O_RDONLY | O_DIRECTORY), fullpath, len, suffix,
+                          error_found);
+}
+
+
+// Checks standard input when path_count is 0, otherwise the given files
+// and directories. Returns whether any misspelling or error was found.
+int check_paths(Dictionary *dict, const char *suffix, int thread_count,
+                int path_count, char **paths) {
+    int error_found = 0;
+    OutBuf out = { NULL, 0, 0, STDOUT_FILENO, 0 };
+    Checker ck = { dict, &out, NULL, &run_stats, NULL, 0, NULL, NULL };
+
+
+    if (path_count == 0) {
+        if (check_file(&ck, NULL, 0))
+            error_found = 1;
+    } else {
+        if (thread_count > 1) ck.pool = start_pool(dict, thread_count);
+        for (int i = 0; i < path_count; i++) {
+            struct stat st;
+            if (stat(paths[i], &st) == 0) {
+                if (S_ISDIR(st.st_mode)) {
+                    PhaseTime phase = phase_start();
+                    PhaseTime checked = run_stats.phases[PHASE_CHECK_FILE];
+                    check_directory(&ck, paths[i], suffix, &error_found);
+                    phase_end(&run_stats.phases[PHASE_CHECK_DIRECTORY], phase);
+                    phase_exclude(&run_stats.phases[PHASE_CHECK_DIRECTORY],
+                                  &run_stats.phases[PHASE_CHECK_FILE], checked);
+                } else {
+                    if (watcher) watch_file(watcher, paths[i]);
+                    visit_file(&ck, paths[i], path_count > 1, &error_found);
+                }
+            } else {
+                out_flush(&out);
+                fprintf(stderr, "Error: Cannot access '%s'\n", paths[i]);
+                error_found = 1;
+            }
+        }
+        if (ck.pool && finish_pool(ck.pool, &run_stats))
+            error_found = 1;
+    }
+    if (out_flush(&out) < 0) error_found = 1;
+    out_free(&out);
+    release_checker(&ck);
+    return error_found;
+}
+
+
+// Daemon protocol. The client connects to the socket and sends one byte
+// carrying its standard input, output and error descriptors, followed by
+// records (a tag byte, a 32-bit length and the payload): the dictionary's
+// real path, the real path of each overlay, the working directory, the
+// suffix, the --suggest count, one record per path and an end record. The
+// daemon checks the request writing straight to the client's descriptors,
+// then answers with a single status byte.
+enum {
+    REPLY_CLEAN,
+    REPLY_ERRORS,
+    REPLY_WRONG_DICTIONARY
+};
+
+
+int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int send_record(int sock, char tag, const char *data) {
+    uint32_t len = data ? strlen(data) : 0;
+    if (write_all(sock, &tag, 1) < 0 || write_all(sock, (const char *)&len, sizeof(len)) < 0)
+        return -1;
+    return write_all(sock, data, len);
+}
+
+
+// Reads one record into a freshly allocated, NUL-terminated string.
+int recv_record(int sock, char *tag, char **data) {
+    uint32_t len;
+    if (read_all(sock, tag, 1) < 0 || read_all(sock, &len, sizeof(len)) < 0 ||
+        len > PATH_BUFFER_SIZE * 16)
+        return -1;
+    *data = malloc(len + 1);
+    if (read_all(sock, *data, len) < 0) {
+        free(*data);
+        return -1;
+    }
+    (*data)[len] = '\0';
+    return 0;
+}
+
+
+int send_std_fds(int sock) {
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char tag = 'F';
+    struct iovec iov = { &tag, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+
+int recv_std_fds(int sock, int fds[3]) {
+    char tag;
+    struct iovec iov = { &tag, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != 1 || tag != 'F') return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    return 0;
+}
+
+
+// Forwards the request to a running daemon. Returns the exit status to use,
+// or -1 when no daemon could take the request and it should be checked in
+// process; nothing has been printed in that case.
+int run_client(const char *socket_path, const char *dict_path, char **overlay_files,
+               int overlay_count, const char *suffix, int path_count, char **paths) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    char *dict_real = realpath(dict_path, NULL);
+    char cwd[PATH_BUFFER_SIZE];
+    if (!dict_real || !getcwd(cwd, sizeof(cwd))) {
+        free(dict_real);
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) close(sock);
+        free(dict_real);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int failed = send_std_fds(sock) < 0 || send_record(sock, 'D', dict_real) < 0;
+    for (int i = 0; i < overlay_count && !failed; i++) {
+        // An overlay that cannot be resolved goes as given; it will not
+        // match, and checking in process reports the error.
+        char *overlay_real = realpath(overlay_files[i], NULL);
+        failed = send_record(sock, 'O', overlay_real ? overlay_real : overlay_files[i]) < 0;
+        free(overlay_real);
+    }
+    if (!failed)
+        failed = send_record(sock, 'C', cwd) < 0 || send_record(sock, 'S', suffix) < 0;
+    char limit[16];
+    snprintf(limit, sizeof(limit), "%d", suggestion_limit);
+    if (!failed) failed = send_record(sock, 'K', limit) < 0;
+    for (int i = 0; i < path_count && !failed; i++)
+        failed = send_record(sock, 'P', paths[i]) < 0;
+    if (!failed) failed = send_record(sock, 'E', NULL) < 0;
+    free(dict_real);
+
+    unsigned char status;
+    if (failed || read_all(sock, &status, 1) < 0) {
+        close(sock);
+        // The daemon may already have printed part of the report, so
+        // checking again here could repeat it.
+        fprintf(stderr, "Error: Lost connection to spell daemon at '%s'\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    close(sock);
+    if (status == REPLY_WRONG_DICTIONARY) return -1;
+    return status == REPLY_CLEAN ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+volatile sig_atomic_t stop_serving = 0;
+
+
+void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_serving = 1;
+}
+
+
+void serve_request(int client, Dictionary *dict, const char *dict_real, char **overlay_real,
+                   int overlay_count, int thread_count, int stats_json, const int saved_fds[3]) {
+    int fds[3];
+    if (recv_std_fds(client, fds) < 0) return;
+
+    char *dictionary = NULL, *cwd = NULL, *suffix = NULL;
+    char **paths = NULL;
+    int path_count = 0, path_capacity = 0, complete = 0, limit = 0;
+    int overlay_index = 0, overlays_match = 1;
+    char tag;
+    char *data;
+    while (!complete && recv_record(client, &tag, &data) == 0) {
+        switch (tag) {
+        case 'D': free(dictionary); dictionary = data; break;
+        case 'O':
+            overlays_match &= overlay_index < overlay_count &&
+                              strcmp(data, overlay_real[overlay_index]) == 0;
+            overlay_index++;
+            free(data);
+            break;
+        case 'C': free(cwd); cwd = data; break;
+        case 'S': free(suffix); suffix = data; break;
+        case 'K': limit = atoi(data); free(data); break;
+        case 'P':
+            if (path_count == path_capacity) {
+                path_capacity = path_capacity ? path_capacity * 2 : 16;
+                paths = realloc(paths, path_capacity * sizeof(char *));
+            }
+            paths[path_count++] = data;
+            break;
+        case 'E': complete = 1; free(data); break;
+        default: free(data); break;
+        }
+    }
+
+    // A daemon serving another dictionary or other overlays, or a trie when
+    // suggestions are asked for, sends the client back to check the request
+    // itself.
+    unsigned char status = REPLY_WRONG_DICTIONARY;
+    if (complete && dictionary && cwd && suffix && strcmp(dictionary, dict_real) == 0 &&
+        overlays_match && overlay_index == overlay_count && !(limit && dict->trie) &&
+        chdir(cwd) == 0) {
+        for (int i = 0; i < 3; i++) dup2(fds[i], i);
+        suggestion_limit = limit >= 0 && limit <= SUGGEST_MAX ? limit : 0;
+        if (suggestion_limit && !suggest_automaton && !dict->deletes) {
+            build_suggestion_index(dict);
+            for (int i = 0; i < dict->overlay_count; i++)
+                build_suggestion_index(dict->overlays[i]);
+        }
+        int error_found = check_paths(dict, suffix, thread_count, path_count, paths);
+        if (stats_enabled) {
+            print_stats(&run_stats, stats_json);
+            memset(&run_stats, 0, sizeof(run_stats));
+        }
+        for (int i = 0; i < 3; i++) dup2(saved_fds[i], i);
+        status = error_found ? REPLY_ERRORS : REPLY_CLEAN;
+    }
+    write_all(client, (const char *)&status, 1);
+
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    for (int i = 0; i < path_count; i++) free(paths[i]);
+    free(paths);
+    free(dictionary);
+    free(cwd);
+    free(suffix);
+}
+
+
+// Only processes of the daemon's own user may use it: a request makes the
+// daemon read files on the client's behalf.
+int accept_peer(int client) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != geteuid()) {
+        fprintf(stderr, "Error: Refused a connection from another user\n");
+        return 0;
+    }
+    // A client that stops sending would otherwise hold up every other one.
+    struct timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return 1;
+}
+
+
+// Answers requests on socket_path one at a time until SIGINT or SIGTERM.
+// Each request runs in the client's working directory; the daemon goes
+// back to its own afterwards, and a relative socket path is resolved
+// against it up front.
+int serve(const char *socket_path, Dictionary *dict, const char *dict_path, char **overlay_files,
+          int overlay_count, int thread_count, int stats_json) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    char cwd[PATH_BUFFER_SIZE];
+    int n;
+    if (socket_path[0] == '/')
+        n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    else if (getcwd(cwd, sizeof(cwd)))
+        n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", cwd, socket_path);
+    else
+        n = -1;
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+
+    // Clients name their dictionaries by real path, so every one of ours
+    // needs one.
+    char *dict_real = realpath(dict_path, NULL);
+    char **overlay_real = calloc(overlay_count + 1, sizeof(char *));
+    for (int i = 0; i < overlay_count; i++) {
+        overlay_real[i] = realpath(overlay_files[i], NULL);
+        if (!overlay_real[i]) {
+            fprintf(stderr, "Error: Cannot resolve dictionary '%s'\n", overlay_files[i]);
+            for (int j = 0; j < i; j++) free(overlay_real[j]);
+            free(overlay_real);
+            free(dict_real);
+            return 1;
+        }
+    }
+    int home = open(".", O_RDONLY | O_DIRECTORY);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(addr.sun_path);
+    // The socket is made accessible to its owner only.
+    mode_t mask = umask(0077);
+    int bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!dict_real || home < 0 || !bound || listen(listener, 64) < 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s'\n", socket_path);
+        if (listener >= 0) close(listener);
+        if (home >= 0) close(home);
+        for (int i = 0; i < overlay_count; i++) free(overlay_real[i]);
+        free(overlay_real);
+        free(dict_real);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    int saved_fds[3] = { dup(STDIN_FILENO), dup(STDOUT_FILENO), dup(STDERR_FILENO) };
+
+    while (!stop_serving) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: Cannot accept connections on '%s'\n", socket_path);
+            break;
+        }
+        if (accept_peer(client))
+            serve_request(client, dict, dict_real, overlay_real, overlay_count, thread_count,
+                          stats_json, saved_fds);
+        close(client);
+        if (fchdir(home) != 0) {
+            fprintf(stderr, "Error: Cannot return to the daemon's directory\n");
+            break;
+        }
+    }
+
+    close(listener);
+    close(home);
+    unlink(addr.sun_path);
+    for (int i = 0; i < 3; i++) close(saved_fds[i]);
+    for (int i = 0; i < overlay_count; i++) free(overlay_real[i]);
+    free(overlay_real);
+    free(dict_real);
+    return 0;
+}
+
+
+// Whether path is dir, whose length is len, or below it.
+int path_within(const char *path, const char *dir, size_t len) {
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+
+// Stops watching a directory that moved away, and everything below it.
+void unwatch_tree(Watcher *w, const char *path) {
+    size_t len = strlen(path);
+    for (int i = 0; i < w->dir_capacity; i++) {
+        WatchDir *dir = &w->dirs[i];
+        if (dir->path && path_within(dir->path, path, len)) {
+            inotify_rm_watch(w->fd, i);
+            forget_watch(dir);
+        }
+    }
+}
+
+
+// Replaces the first len bytes of *path with to.
+void rename_path(char **path, size_t len, const char *to) {
+    size_t to_len = strlen(to), rest = strlen(*path + len);
+    char *renamed = malloc(to_len + rest + 1);
+    memcpy(renamed, to, to_len);
+    memcpy(renamed + to_len, *path + len, rest + 1);
+    free(*path);
+    *path = renamed;
+}
+
+
+// Follows a directory moved within the tree. Its watches still hold, so
+// only the paths kept for it and everything below it change. Returns how
+// many watched directories were renamed.
+int rename_tree(Watcher *w, const char *from, const char *to) {
+    size_t len = strlen(from);
+    int renamed = 0;
+    for (int i = 0; i < w->dir_capacity; i++) {
+        WatchDir *dir = &w->dirs[i];
+        if (!dir->path || !path_within(dir->path, from, len)) continue;
+        rename_path(&dir->path, len, to);
+        for (int j = 0; j < dir->file_count; j++)
+            if (path_within(dir->files[j], from, len)) rename_path(&dir->files[j], len, to);
+        renamed++;
+    }
+    return renamed;
+}
+
+
+// A directory moved away whose IN_MOVED_TO did not follow has left the
+// tree.
+void finish_move(Watcher *w) {
+    if (!w->move_path) return;
+    unwatch_tree(w, w->move_path);
+    free(w->move_path);
+    w->move_path = NULL;
+}
+
+
+// Handles one inotify event. Changed files are added to w->changes. New
+// directories are walked, and so watched, straight away, and their files
+// added too. A directory moved within the tree keeps its watches.
+void handle_watch_event(Checker *ck, Watcher *w, const struct inotify_event *event,
+                        int *error_found) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Error: Too many changes at once; some were not checked\n");
+        return;
+    }
+    if (event->wd < 0 || event->wd >= w->dir_capacity) return;
+    WatchDir *dir = &w->dirs[event->wd];
+    if (event->mask & IN_IGNORED) {
+        forget_watch(dir);
+        return;
+    }
+    if (!dir->path || event->len == 0) return;
+
+    const char *name = event->name;
+    char path[PATH_BUFFER_SIZE];
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir->path, name) >= sizeof(path)) {
+        fprintf(stderr, "Error: Path too long in '%s'\n", dir->path);
+        return;
+    }
+    if (event->mask & IN_ISDIR) {
+        // The kernel queues the two halves of a rename together.
+        int walk = dir->recursive && name[0] != '.';
+        if (event->mask & IN_MOVED_FROM) {
+            finish_move(w);
+            w->move_cookie = event->cookie;
+            w->move_path = strdup(path);
+            return;
+        }
+        if ((event->mask & IN_MOVED_TO) && w->move_path && event->cookie == w->move_cookie &&
+            walk && rename_tree(w, w->move_path, path)) {
+            free(w->move_path);
+            w->move_path = NULL;
+            return;
+        }
+        finish_move(w);
+        if (walk) check_directory(ck, path, w->suffix, error_found);
+        return;
+    }
+    // A new file is checked once it has been written and closed.
+    if (event->mask & (IN_CREATE | IN_MOVED_FROM)) return;
+
+    size_t name_len = strlen(name), suffix_len = strlen(w->suffix);
+    if (dir->recursive && name[0] != '.' && name_len >= suffix_len &&
+        strcmp(name + name_len - suffix_len, w->suffix) == 0)
+        add_change(w, path, 1);
+    for (int i = 0; i < dir->file_count; i++) {
+        const char *slash = strrchr(dir->files[i], '/');
+        if (strcmp(slash ? slash + 1 : dir->files[i], name) == 0)
+            add_change(w, dir->files[i], w->show_filename);
+    }
+}
+
+
+// Checks files again as they change until SIGINT or SIGTERM. Each batch of
+// events is answered as soon as it is read, with no settling delay: a save
+// is complete by the time its IN_CLOSE_WRITE or IN_MOVED_TO arrives. Events
+// queued while the batch was handled, such as a file found by walking a new
+// directory being closed, join it, so that such a file is checked once.
+int watch_changes(Watcher *w, Dictionary *dict) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    OutBuf out = { NULL, 0, 0, STDOUT_FILENO, 0 };
+    Checker ck = { dict, &out, NULL, &run_stats, NULL, 0, NULL, NULL };
+    union {
+        struct inotify_event align;
+        char buf[64 * 1024];
+    } events;
+    int failed = 0;
+    while (!stop_serving) {
+        ssize_t n = read(w->fd, events.buf, sizeof(events.buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error: Cannot read file change events\n");
+            failed = 1;
+            break;
+        }
+
+        int error_found = 0;
+        w->collecting = 1;
+        for (int round = 0; round < 2 && n > 0; round++) {
+            for (char *p = events.buf; p < events.buf + n;) {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                handle_watch_event(&ck, w, event, &error_found);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            struct pollfd pending = { w->fd, POLLIN, 0 };
+            if (round > 0 || poll(&pending, 1, 0) <= 0) break;
+            n = read(w->fd, events.buf, sizeof(events.buf));
+        }
+        w->collecting = 0;
+        finish_move(w);
+        for (int i = 0; i < w->change_count; i++) {
+            check_file(&ck, w->changes[i].path, w->changes[i].show_filename);
+            free(w->changes[i].path);
+        }
+        free(w->changes);
+        w->changes = NULL;
+        w->change_count = 0;
+        if (out_flush(&out) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+    out_free(&out);
+    release_checker(&ck);
+    return failed;
+}
+
+
+// bench.c includes this file to drive the functions above directly.
+#ifndef SPELL_NO_MAIN
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: spell [-s {suffix}] {dictionary} [{file or directory}]*\n");
+        fprintf(stderr, "Usage: spell [-s {suffix}] [-j {threads}] [--index {hash|sorted|trie}]\n"
+                        "             [--stats[=json]] [--bloom[={bits}]] [--suggest[={count}]]\n"
+                        "             [--suggest-engine {deletes|automaton}]\n"
+                        "             [--cache {file}] [--connect {socket}] [-d {dictionary}]*\n"
+                        "             [--watch]\n"
+                        "             {dictionary} [{file or directory}]*\n"
+                        "       spell [-j {threads}] [--index {hash|sorted|trie}]\n"
+                        "             [--stats[=json]] [--bloom[={bits}]] [--suggest[={count}]]\n"
+                        "             [--suggest-engine {deletes|automaton}] [-d {dictionary}]*\n"
+                        "             --serve {socket} {dictionary}\n"
+                        "       spell --compile [--suggest] {dictionary} -o {output}\n"
+                        "\n"
+                        "--suggest indexes the dictionary first unless it was compiled with\n"
+                        "--suggest. The automaton engine needs no index but is much slower per\n"
+                        "misspelling; 'make bench' times both.\n"
+                        "\n"
+                        "With --watch the exit status only tells whether watching failed, not\n"
+                        "whether any check found misspellings.\n");
         return EXIT_FAILURE;
     }
 
 
+    // --suggest stores the delete index too, which makes the file several
+    // times larger but saves building it on every run with --suggest.
+    if (strcmp(argv[1], "--compile") == 0) {
+        int with_deletes = argc > 2 && strcmp(argv[2], "--suggest") == 0;
+        if (argc != 5 + with_deletes || strcmp(argv[3 + with_deletes], "-o") != 0) {
+            fprintf(stderr, "Error: --compile requires [--suggest] {dictionary} -o {output}\n");
+            return EXIT_FAILURE;
+        }
+        Dictionary *dict = load_dictionary(argv[2 + with_deletes]);
+        if (!dict) return EXIT_FAILURE;
+        build_hash_index(dict);
+        if (with_deletes) build_suggestion_index(dict);
+        int status = compile_dictionary(dict, argv[4 + with_deletes]);
+        free_dictionary(dict);
+        return status ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+
     const char *suffix = ".txt";
     int arg_idx = 1;
 
 
-    if (strcmp(argv[arg_idx], "-s") == 0) {
-        if (arg_idx + 1 >= argc) {
-            fprintf(stderr, "Error: -s requires a suffix argument\n");
-            return EXIT_FAILURE;
+    const char *index_kind = "hash";
+    int thread_count = 1;
+    int stats_json = 0;
+    int bloom_bits = 0;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    const char *cache_path = NULL;
+    char **overlay_files = malloc(argc * sizeof(char *));
+    int overlay_count = 0;
+    int watch = 0;
+    while (arg_idx < argc) {
+        if (strcmp(argv[arg_idx], "-s") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -s requires a suffix argument\n");
+                return EXIT_FAILURE;
+            }
+            suffix = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "-d") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -d requires a dictionary argument\n");
+                return EXIT_FAILURE;
+            }
+            overlay_files[overlay_count++] = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--index") == 0) {
+            if (arg_idx + 1 >= argc ||
+                (strcmp(argv[arg_idx + 1], "hash") != 0 &&
+                 strcmp(argv[arg_idx + 1], "sorted") != 0 &&
+                 strcmp(argv[arg_idx + 1], "trie") != 0)) {
+                fprintf(stderr, "Error: --index requires 'hash', 'sorted' or 'trie'\n");
+                return EXIT_FAILURE;
+            }
+            index_kind = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--suggest-engine") == 0) {
+            if (arg_idx + 1 >= argc ||
+                (strcmp(argv[arg_idx + 1], "deletes") != 0 &&
+                 strcmp(argv[arg_idx + 1], "automaton") != 0)) {
+                fprintf(stderr, "Error: --suggest-engine requires 'deletes' or 'automaton'\n");
+                return EXIT_FAILURE;
+            }
+            suggest_automaton = argv[arg_idx + 1][0] == 'a';
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--cache") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: --cache requires a file argument\n");
+                return EXIT_FAILURE;
+            }
+            cache_path = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--watch") == 0) {
+            watch = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "-j") == 0) {
+            if (arg_idx + 1 >= argc || (thread_count = atoi(argv[arg_idx + 1])) < 1) {
+                fprintf(stderr, "Error: -j requires a positive thread count\n");
+                return EXIT_FAILURE;
+            }
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--stats") == 0 ||
+                   strcmp(argv[arg_idx], "--stats=json") == 0) {
+            stats_enabled = 1;
+            stats_json = argv[arg_idx][7] == '=';
+            arg_idx++;
+        } else if (strncmp(argv[arg_idx], "--bloom", 7) == 0 &&
+                   (argv[arg_idx][7] == '\0' || argv[arg_idx][7] == '=')) {
+            bloom_bits = argv[arg_idx][7] ? atoi(argv[arg_idx] + 8) : BLOOM_DEFAULT_BITS;
+            if (bloom_bits < 1 || bloom_bits > 64) {
+                fprintf(stderr, "Error: --bloom takes 1 to 64 bits per word\n");
+                return EXIT_FAILURE;
+            }
+            arg_idx++;
+        } else if (strncmp(argv[arg_idx], "--suggest", 9) == 0 &&
+                   (argv[arg_idx][9] == '\0' || argv[arg_idx][9] == '=')) {
+            suggestion_limit = argv[arg_idx][9] ? atoi(argv[arg_idx] + 10) : SUGGEST_DEFAULT;
+            if (suggestion_limit < 1 || suggestion_limit > SUGGEST_MAX) {
+                fprintf(stderr, "Error: --suggest takes a count from 1 to %d\n", SUGGEST_MAX);
+                return EXIT_FAILURE;
+            }
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--serve") == 0 ||
+                   strcmp(argv[arg_idx], "--connect") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires a socket path\n", argv[arg_idx]);
+                return EXIT_FAILURE;
+            }
+            if (argv[arg_idx][2] == 's')
+                serve_path = argv[arg_idx + 1];
+            else
+                connect_path = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else {
+            break;
         }
-        suffix = argv[arg_idx + 1];
-        arg_idx += 2;
     }
 
 
@@ -363,40 +3876,112 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: Dictionary file required\n");
         return EXIT_FAILURE;
     }
+    if (cache_path && serve_path) {
+        fprintf(stderr, "Error: --cache cannot be used with --serve\n");
+        return EXIT_FAILURE;
+    }
+    if (watch && (serve_path || connect_path)) {
+        fprintf(stderr, "Error: --watch cannot be used with --serve or --connect\n");
+        return EXIT_FAILURE;
+    }
+    if (watch && arg_idx + 1 >= argc) {
+        fprintf(stderr, "Error: --watch requires files or directories to watch\n");
+        return EXIT_FAILURE;
+    }
+    if (suggestion_limit && strcmp(index_kind, "trie") == 0) {
+        fprintf(stderr, "Error: --suggest cannot be used with --index trie\n");
+        return EXIT_FAILURE;
+    }
 
 
     const char *dict_file = argv[arg_idx++];
+    if (connect_path && !serve_path) {
+        int status = run_client(connect_path, dict_file, overlay_files, overlay_count, suffix,
+                                argc - arg_idx, argv + arg_idx);
+        if (status >= 0) return status;
+    }
+
+
+    select_tokenizer();
+    PhaseTime phase = phase_start();
+    PhaseTime sorted = run_stats.phases[PHASE_SORT_DICTIONARY];
     Dictionary *dict = load_dictionary(dict_file);
     if (!dict) return EXIT_FAILURE;
+    if (strcmp(index_kind, "hash") == 0)
+        build_hash_index(dict);
+    else
+        dict->slots = NULL;
+    if (bloom_bits) build_bloom_filter(dict, bloom_bits);
+    uint64_t base_hash = cache_path ? hash_bytes(dict->data, dict->size) : 0;
+    if (strcmp(index_kind, "trie") == 0) dict = build_trie_dictionary(dict);
+    // Overlays are searched, not walked as a trie, so they keep a hash
+    // index unless the sorted index was asked for.
+    for (int i = 0; i < overlay_count; i++) {
+        Dictionary *overlay = load_dictionary(overlay_files[i]);
+        if (!overlay) {
+            free_dictionary(dict);
+            return EXIT_FAILURE;
+        }
+        if (strcmp(index_kind, "sorted") == 0)
+            overlay->slots = NULL;
+        else
+            build_hash_index(overlay);
+        add_overlay(dict, overlay);
+    }
+    phase_end(&run_stats.phases[PHASE_LOAD_DICTIONARY], phase);
+    phase_exclude(&run_stats.phases[PHASE_LOAD_DICTIONARY],
+                  &run_stats.phases[PHASE_SORT_DICTIONARY], sorted);
+    // Cached reports depend on the dictionaries and the --suggest options.
+    if (cache_path)
+        check_cache = load_cache(cache_path, dictionary_fingerprint(dict, base_hash) ^
+                                                 suggestion_limit ^
+                                                 (uint64_t)suggest_automaton << 8);
+    if (suggestion_limit && !suggest_automaton) {
+        build_suggestion_index(dict);
+        for (int i = 0; i < dict->overlay_count; i++) build_suggestion_index(dict->overlays[i]);
+    }
 
 
-    int error_found = 0;
+    if (serve_path || watch) map_input_files = 0;
+    if (serve_path) {
+        int status = serve(serve_path, dict, dict_file, overlay_files, overlay_count,
+                           thread_count, stats_json);
+        free_dictionary(dict);
+        free(overlay_files);
+        return status ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
 
-    if (arg_idx >= argc) {
-        if (check_file(dict, NULL, 0))
-            error_found = 1;
-    } else {
-        int file_count = argc - arg_idx;
-        for (int i = arg_idx; i < argc; i++) {
-            struct stat st;
-            if (stat(argv[i], &st) == 0) {
-                if (S_ISDIR(st.st_mode)) {
-                    check_directory(dict, argv[i], suffix, &error_found);
-                } else {
-                    if (check_file(dict, argv[i], file_count > 1))
-                        error_found = 1;
-                }
-            } else {
-                fprintf(stderr, "Error: Cannot access '%s'\n", argv[i]);
-                error_found = 1;
-            }
+    // The first check registers the watches, then files are checked again
+    // as they change; the status is then that of watching itself.
+    if (watch) {
+        watcher = calloc(1, sizeof(Watcher));
+        watcher->fd = inotify_init1(IN_CLOEXEC);
+        watcher->suffix = suffix;
+        watcher->show_filename = argc - arg_idx > 1;
+        if (watcher->fd < 0) {
+            fprintf(stderr, "Error: Cannot watch for file changes\n");
+            free(watcher);
+            free_dictionary(dict);
+            return EXIT_FAILURE;
         }
     }
+    int error_found = check_paths(dict, suffix, thread_count, argc - arg_idx, argv + arg_idx);
+    if (watcher) {
+        error_found = watch_changes(watcher, dict);
+        free_watcher(watcher);
+    }
+    if (stats_enabled) print_stats(&run_stats, stats_json);
+    if (check_cache) {
+        save_cache(check_cache, cache_path);
+        free_cache(check_cache);
+    }
 
 
     free_dictionary(dict);
+    free(overlay_files);
     return error_found ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+#endif
 
 
@@ -0,0 +1,289 @@
+#!/bin/sh
+# Checks spell against the fixtures in this directory. Every index, thread
+# count, Bloom filter setting and form of the dictionary must give the
+# reports in expected/, as must both suggestion engines, overlays, the
+# cache, the daemon and --watch.
+#
+#   make check
+#   sh tests/check.sh [{spell binary}]
+SPELL=${1:-./spell}
+T=$(dirname "$0")
+FILES="$T/corpus/intro.txt $T/corpus/notes/writers.txt $T/corpus/noeol.txt"
+tmp=$(mktemp -d)
+daemon=
+trap 'if [ -n "$daemon" ]; then kill $daemon; fi; rm -rf "$tmp"' EXIT
+failures=0
+
+
+# expect NAME EXPECTED COMMAND...: runs COMMAND and compares its output and
+# exit status with the file EXPECTED.
+expect() {
+    name=$1
+    expected=$2
+    shift 2
+    "$@" > "$tmp/out" 2> "$tmp/err"
+    echo "exit $?" >> "$tmp/out"
+    if ! cmp -s "$expected" "$tmp/out"; then
+        echo "FAIL: $name"
+        diff "$expected" "$tmp/out" | head -20
+        cat "$tmp/err"
+        failures=$((failures + 1))
+    fi
+}
+
+
+# cache_hits COMMAND...: runs COMMAND with --stats=json, printing only how
+# many reports came from the cache.
+cache_hits() {
+    "$@" 2>&1 > /dev/null | sed -n 's/.*"cache_hits": \([0-9]*\).*/\1/p'
+}
+
+
+# refused NAME COMMAND...: checks that COMMAND fails, in good time, saying
+# that the dictionary it was given has an unsupported format.
+refused() {
+    name=$1
+    shift
+    timeout 10 "$@" > /dev/null 2> "$tmp/err"
+    status=$?
+    if [ $status -ne 1 ] || ! grep -q 'unsupported format' "$tmp/err"; then
+        echo "FAIL: $name: exit $status"
+        cat "$tmp/err"
+        failures=$((failures + 1))
+    fi
+}
+
+
+# served NAME yes|no: checks whether the daemon served the last request,
+# which it runs with --stats, printing them to the client's stderr.
+served() {
+    if grep -q '^files' "$tmp/err"; then got=yes; else got=no; fi
+    if [ $got != $2 ]; then
+        echo "FAIL: $1: served by the daemon: $got"
+        failures=$((failures + 1))
+    fi
+}
+
+
+# Indexes, threads, Bloom filters and compiled dictionaries. Directories
+# are walked in whatever order the file system gives, so the walk is
+# compared with the default run of the same tree rather than with a fixed
+# file.
+"$SPELL" --compile "$T/dict.txt" -o "$tmp/dict.spd"
+# Compiling over the dictionary being read must leave it whole.
+"$SPELL" --compile "$tmp/dict.spd" -o "$tmp/dict.spd"
+{ "$SPELL" "$T/dict.txt" "$T/corpus"; echo "exit $?"; } > "$tmp/walk.txt"
+for dict in "$T/dict.txt" "$tmp/dict.spd"; do
+    for index in hash sorted trie; do
+        for threads in 1 4; do
+            for bloom in "" --bloom; do
+                args="--index $index -j $threads $bloom"
+                expect "$args $dict" "$T/expected/plain.txt" "$SPELL" $args "$dict" $FILES
+                expect "$args $dict (walk)" "$tmp/walk.txt" "$SPELL" $args "$dict" "$T/corpus"
+            done
+        done
+    done
+done
+# A truncated .spd, one with an entry past the end of the words, and one
+# whose hash table is full, which no compile writes and whose probes would
+# never stop, are refused.
+head -c 200 "$tmp/dict.spd" > "$tmp/truncated.spd"
+refused "truncated .spd" "$SPELL" "$tmp/truncated.spd" $FILES
+cp "$tmp/dict.spd" "$tmp/entry.spd"
+printf '\377\377\377\000' | dd of="$tmp/entry.spd" bs=1 seek=72 conv=notrunc 2> /dev/null
+refused "damaged .spd entry" "$SPELL" "$tmp/entry.spd" $FILES
+cp "$tmp/dict.spd" "$tmp/full.spd"
+slot_count=$(od -An -tu4 -j16 -N4 "$tmp/dict.spd" | tr -d ' ')
+slots_offset=$(od -An -tu8 -j24 -N8 "$tmp/dict.spd" | tr -d ' ')
+i=0
+while [ $i -lt "$slot_count" ]; do
+    printf '\001\000\000\000\000\000\000\000\001\000\000\000'
+    i=$((i + 1))
+done | dd of="$tmp/full.spd" bs=1 seek="$slots_offset" conv=notrunc 2> /dev/null
+refused "full .spd" "$SPELL" "$tmp/full.spd" $FILES
+
+# Threads that cannot be started, for want of address space for their
+# stacks, leave the files to those that can.
+expect "-j 64 in 200 MB" "$T/expected/plain.txt" \
+    sh -c 'ulimit -v 200000 && exec "$@"' sh "$SPELL" -j 64 "$T/dict.txt" $FILES
+
+sed -n 's|^.*/intro.txt:||p; $p' "$T/expected/plain.txt" > "$tmp/stdin.txt"
+expect "standard input" "$tmp/stdin.txt" "$SPELL" "$T/dict.txt" < "$T/corpus/intro.txt"
+
+
+# Suggestions, with both engines, from a dictionary compiled with its delete
+# index, and from overlays, which must come in the same order whichever
+# order they are given in.
+"$SPELL" --compile --suggest "$T/dict.txt" -o "$tmp/deletes.spd"
+for engine in deletes automaton; do
+    for threads in 1 4; do
+        for index in hash sorted; do
+            args="--suggest-engine $engine -j $threads --index $index"
+            expect "--suggest $args" "$T/expected/suggest.txt" \
+                "$SPELL" --suggest $args "$T/dict.txt" $FILES
+            expect "--suggest $args (compiled)" "$T/expected/suggest.txt" \
+                "$SPELL" --suggest $args "$tmp/dict.spd" $FILES
+            expect "--suggest $args (compiled with --suggest)" "$T/expected/suggest.txt" \
+                "$SPELL" --suggest $args "$tmp/deletes.spd" $FILES
+            expect "overlays $args" "$T/expected/overlays.txt" \
+                "$SPELL" --suggest=5 $args -d "$T/overlay1.txt" -d "$T/overlay2.txt" \
+                "$T/dict.txt" $FILES
+            expect "overlays reversed $args" "$T/expected/overlays.txt" \
+                "$SPELL" --suggest=5 $args -d "$T/overlay2.txt" -d "$T/overlay1.txt" \
+                "$T/dict.txt" $FILES
+        done
+    done
+done
+# A delete index whose buckets run past its end, and one whose pairs name
+# entries past the last, give no suggestions from them but never crash.
+cp "$tmp/deletes.spd" "$tmp/buckets.spd"
+buckets_offset=$(od -An -tu8 -j48 -N8 "$tmp/deletes.spd" | tr -d ' ')
+deletes_offset=$(od -An -tu8 -j56 -N8 "$tmp/deletes.spd" | tr -d ' ')
+delete_count=$(od -An -tu8 -j64 -N8 "$tmp/deletes.spd" | tr -d ' ')
+i=0
+while [ $i -lt $(((deletes_offset - buckets_offset) / 16)) ]; do
+    printf '\000\000\000\000\000\000\000\000\377\377\377\377\377\377\377\000'
+    i=$((i + 1))
+done | dd of="$tmp/buckets.spd" bs=1 seek="$buckets_offset" conv=notrunc 2> /dev/null
+cp "$tmp/deletes.spd" "$tmp/pairs.spd"
+i=0
+while [ $i -lt "$delete_count" ]; do
+    printf '\377\377\377\177' |
+        dd of="$tmp/pairs.spd" bs=1 seek=$((deletes_offset + i * 8)) conv=notrunc 2> /dev/null
+    i=$((i + 1))
+done
+for damage in buckets pairs; do
+    timeout 10 "$SPELL" --suggest "$tmp/$damage.spd" $FILES > /dev/null 2> "$tmp/err"
+    status=$?
+    if [ $status -ne 1 ]; then
+        echo "FAIL: damaged delete index ($damage): exit $status"
+        cat "$tmp/err"
+        failures=$((failures + 1))
+    fi
+done
+
+
+# The cache gives the same reports, takes them from the cache the second
+# time, and checks a file again once it changes.
+cp -R "$T/corpus" "$tmp/corpus"
+for threads in 1 4; do
+    rm -f "$tmp/cache"
+    { "$SPELL" "$T/dict.txt" "$tmp/corpus"; echo "exit $?"; } > "$tmp/uncached.txt"
+    expect "--cache -j $threads" "$tmp/uncached.txt" \
+        "$SPELL" -j $threads --cache "$tmp/cache" "$T/dict.txt" "$tmp/corpus"
+    hits=$(cache_hits "$SPELL" -j $threads --stats=json --cache "$tmp/cache" "$T/dict.txt" \
+                      "$tmp/corpus")
+    if [ "$hits" != 3 ]; then
+        echo "FAIL: --cache -j $threads: $hits of 3 reports from the cache"
+        failures=$((failures + 1))
+    fi
+    echo "wrtten at $threads" >> "$tmp/corpus/noeol.txt"
+    { "$SPELL" "$T/dict.txt" "$tmp/corpus"; echo "exit $?"; } > "$tmp/uncached.txt"
+    expect "--cache -j $threads after a change" "$tmp/uncached.txt" \
+        "$SPELL" -j $threads --cache "$tmp/cache" "$T/dict.txt" "$tmp/corpus"
+done
+
+# A damaged cache file is used as far as it is whole and never crashes a
+# run: one cut short in the middle of a record, and one whose first record
+# has lengths far beyond the end of the file.
+size=$(wc -c < "$tmp/cache")
+head -c $((size - 10)) "$tmp/cache" > "$tmp/truncated.cache"
+cp "$tmp/cache" "$tmp/lengths.cache"
+printf '\377\377\377\377\000\000\000\000\377\377\377\377\377\377\377\377' |
+    dd of="$tmp/lengths.cache" bs=1 seek=24 conv=notrunc 2> /dev/null
+for damage in truncated lengths; do
+    expect "--cache $damage" "$tmp/uncached.txt" \
+        "$SPELL" --cache "$tmp/$damage.cache" "$T/dict.txt" "$tmp/corpus"
+done
+
+# A change to the dictionary checks every file again, whatever the index.
+echo "Hello wrld" > "$tmp/wrld.txt"
+printf 'exit 0\n' > "$tmp/clean.txt"
+for index in hash trie; do
+    rm -f "$tmp/cache"
+    cp "$T/dict.txt" "$tmp/dict.txt"
+    "$SPELL" --index $index --cache "$tmp/cache" "$tmp/dict.txt" "$tmp/wrld.txt" > /dev/null
+    echo wrld >> "$tmp/dict.txt"
+    expect "--cache --index $index after a dictionary change" "$tmp/clean.txt" \
+        "$SPELL" --index $index --cache "$tmp/cache" "$tmp/dict.txt" "$tmp/wrld.txt"
+done
+
+
+# The daemon, which must give the same reports as checking in process, and
+# a request for other dictionaries, which falls back to checking in process.
+"$SPELL" --stats --serve "$tmp/sock" "$T/dict.txt" &
+daemon=$!
+tries=0
+while [ ! -S "$tmp/sock" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+expect "--connect" "$T/expected/plain.txt" \
+    "$SPELL" --connect "$tmp/sock" "$T/dict.txt" $FILES
+served --connect yes
+expect "--connect --suggest" "$T/expected/suggest.txt" \
+    "$SPELL" --connect "$tmp/sock" --suggest "$T/dict.txt" $FILES
+served "--connect --suggest" yes
+expect "--connect with overlays" "$T/expected/overlays.txt" \
+    "$SPELL" --connect "$tmp/sock" --suggest=5 -d "$T/overlay1.txt" -d "$T/overlay2.txt" \
+    "$T/dict.txt" $FILES
+served "--connect with overlays" no
+kill $daemon
+wait $daemon
+daemon=
+
+
+# --watch reports each changed file once: one edited, that of a directory
+# moved into the tree and then renamed, and one written to a directory just
+# made. Each change waits for the report of the one before.
+mkdir "$tmp/watched" "$tmp/new"
+echo wrd > "$tmp/watched/a.txt"
+echo nwe > "$tmp/new/b.txt"
+"$SPELL" --watch "$T/dict.txt" "$tmp/watched" > "$tmp/watch.txt" 2>&1 &
+daemon=$!
+reports=0
+# reported: waits for one more line of reports.
+reported() {
+    reports=$((reports + 1))
+    tries=0
+    while [ "$(wc -l < "$tmp/watch.txt")" -lt $reports ] && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+}
+reported
+echo edt > "$tmp/watched/a.txt"
+reported
+mv "$tmp/new" "$tmp/watched/new"
+reported
+mv "$tmp/watched/new" "$tmp/watched/moved"
+echo mvd > "$tmp/watched/moved/b.txt"
+reported
+mkdir "$tmp/watched/made"
+echo mde > "$tmp/watched/made/c.txt"
+reported
+sleep 0.5
+kill -INT $daemon
+wait $daemon
+echo "exit $?" >> "$tmp/watch.txt"
+daemon=
+{
+    echo "$tmp/watched/a.txt:1:1 wrd"
+    echo "$tmp/watched/a.txt:1:1 edt"
+    echo "$tmp/watched/new/b.txt:1:1 nwe"
+    echo "$tmp/watched/moved/b.txt:1:1 mvd"
+    echo "$tmp/watched/made/c.txt:1:1 mde"
+    echo "exit 0"
+} > "$tmp/watch_expected.txt"
+if ! cmp -s "$tmp/watch_expected.txt" "$tmp/watch.txt"; then
+    echo "FAIL: --watch"
+    diff "$tmp/watch_expected.txt" "$tmp/watch.txt"
+    failures=$((failures + 1))
+fi
+
+
+if [ $failures -ne 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "All checks passed"